@@ -0,0 +1,524 @@
+// benchmark of the stream read/write paths, see README.md
+//
+// usage: eli_stream_extra_bench [-s size_mb] [-f filter]
+// every case moves size_mb of data and reports throughput, latency
+// percentiles of single operations and syscalls per operation
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#endif
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+#include "lstream.h"
+#include "stream.h"
+
+#define BENCH_DEFAULT_SIZE_MB 32
+#define BENCH_TIMEOUT_MS 1000
+
+typedef enum BENCH_TRANSPORT {
+	BENCH_PIPE,
+	BENCH_FILE,
+	BENCH_SOCKET
+} BENCH_TRANSPORT;
+
+static const char *transport_names[] = { "pipe", "file", "socket" };
+
+typedef enum BENCH_OP {
+	BENCH_READ_LINE, // read("l")
+	BENCH_READ_LINE_KEEP, // read("L")
+	BENCH_READ_ALL, // read("a")
+	BENCH_READ_BYTES, // read(n)
+	BENCH_WRITE
+} BENCH_OP;
+
+typedef enum BENCH_IMPL { BENCH_ELI, BENCH_LUA_IO } BENCH_IMPL;
+
+typedef struct BENCH_CASE {
+	BENCH_OP op;
+	// line length for line reads, chunk size otherwise
+	size_t size;
+} BENCH_CASE;
+
+static const BENCH_CASE cases[] = {
+	{ BENCH_READ_LINE, 16 },	{ BENCH_READ_LINE, 128 },
+	{ BENCH_READ_LINE, 1024 },	{ BENCH_READ_LINE_KEEP, 128 },
+	{ BENCH_READ_ALL, 0 },		{ BENCH_READ_BYTES, 64 },
+	{ BENCH_READ_BYTES, 4096 },	{ BENCH_READ_BYTES, 65536 },
+	{ BENCH_WRITE, 16 },		{ BENCH_WRITE, 4096 },
+	{ BENCH_WRITE, 65536 },
+};
+
+typedef struct BENCH_RESULT {
+	size_t ops;
+	size_t bytes;
+	double seconds;
+	long long syscalls; // -1 if they can not be counted
+	long long *samples; // ns per operation
+	size_t samples_capacity;
+} BENCH_RESULT;
+
+static size_t total_size;
+static const char *filter;
+static const char *syscall_source = "n/a";
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// syscall counting prefers the raw_syscalls tracepoint which sees every
+// syscall of this thread, without permissions it falls back to read/write
+// class syscalls from /proc/thread-self/io
+static int syscall_counter = -1;
+
+static void open_syscall_counter(void)
+{
+#ifdef __linux__
+	static const char *id_paths[] = {
+		"/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+		"/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id",
+	};
+	for (size_t i = 0; i < sizeof(id_paths) / sizeof(id_paths[0]); i++) {
+		FILE *f = fopen(id_paths[i], "r");
+		if (f == NULL) {
+			continue;
+		}
+		unsigned long long id;
+		int ok = fscanf(f, "%llu", &id) == 1;
+		fclose(f);
+		if (!ok) {
+			continue;
+		}
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.type = PERF_TYPE_TRACEPOINT;
+		attr.size = sizeof(attr);
+		attr.config = id;
+		attr.disabled = 1;
+		syscall_counter =
+			(int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+		if (syscall_counter >= 0) {
+			syscall_source = "all syscalls (perf tracepoint)";
+			return;
+		}
+	}
+	if (access("/proc/thread-self/io", R_OK) == 0) {
+		syscall_source = "read/write syscalls (/proc/thread-self/io)";
+	}
+#endif
+}
+
+static long long read_proc_io_syscalls(void)
+{
+	FILE *f = fopen("/proc/thread-self/io", "r");
+	if (f == NULL) {
+		return -1;
+	}
+	long long total = 0, value;
+	char name[32];
+	while (fscanf(f, "%31[^:]: %lld\n", name, &value) == 2) {
+		if (strcmp(name, "syscr") == 0 || strcmp(name, "syscw") == 0) {
+			total += value;
+		}
+	}
+	fclose(f);
+	return total;
+}
+
+static long long syscalls_begin(void)
+{
+#ifdef __linux__
+	if (syscall_counter >= 0) {
+		ioctl(syscall_counter, PERF_EVENT_IOC_RESET, 0);
+		ioctl(syscall_counter, PERF_EVENT_IOC_ENABLE, 0);
+		return 0;
+	}
+#endif
+	return read_proc_io_syscalls();
+}
+
+static long long syscalls_end(long long begin)
+{
+#ifdef __linux__
+	if (syscall_counter >= 0) {
+		ioctl(syscall_counter, PERF_EVENT_IOC_DISABLE, 0);
+		long long count;
+		if (read(syscall_counter, &count, sizeof(count)) !=
+		    sizeof(count)) {
+			return -1;
+		}
+		return count;
+	}
+#endif
+	long long end = read_proc_io_syscalls();
+	// reading the proc file itself is one read
+	return begin < 0 || end < 0 ? -1 : end - begin - 1;
+}
+
+static void add_sample(BENCH_RESULT *result, long long ns)
+{
+	if (result->ops == result->samples_capacity) {
+		result->samples_capacity = result->samples_capacity ?
+						   result->samples_capacity * 2 :
+						   4096;
+		result->samples =
+			realloc(result->samples, result->samples_capacity *
+							 sizeof(long long));
+		if (result->samples == NULL) {
+			fprintf(stderr, "not enough memory\n");
+			exit(1);
+		}
+	}
+	result->samples[result->ops++] = ns;
+}
+
+static int compare_samples(const void *a, const void *b)
+{
+	long long x = *(const long long *)a, y = *(const long long *)b;
+	return (x > y) - (x < y);
+}
+
+static long long percentile(BENCH_RESULT *result, double p)
+{
+	if (result->ops == 0) {
+		return 0;
+	}
+	size_t i = (size_t)(p * (result->ops - 1));
+	return result->samples[i];
+}
+
+// data set of lines of given length, or of arbitrary bytes if 0
+static char *create_data(size_t line_length)
+{
+	char *data = malloc(total_size);
+	if (data == NULL) {
+		fprintf(stderr, "not enough memory\n");
+		exit(1);
+	}
+	for (size_t i = 0; i < total_size; i++) {
+		data[i] = line_length > 0 && i % line_length == line_length - 1 ?
+				  '\n' :
+				  'a' + i % 26;
+	}
+	return data;
+}
+
+typedef struct BENCH_PEER {
+	int fd;
+	const char *data; // written to fd if set, otherwise fd is drained
+	pthread_t thread;
+} BENCH_PEER;
+
+static void *run_peer(void *arg)
+{
+	BENCH_PEER *peer = arg;
+	if (peer->data != NULL) {
+		size_t offset = 0;
+		while (offset < total_size) {
+			size_t chunk = total_size - offset < 65536 ?
+					       total_size - offset :
+					       65536;
+			ssize_t res = write(peer->fd, peer->data + offset,
+					    chunk);
+			if (res <= 0) {
+				break;
+			}
+			offset += res;
+		}
+	} else {
+		char sink[65536];
+		while (read(peer->fd, sink, sizeof(sink)) > 0) {
+		}
+	}
+	close(peer->fd);
+	return NULL;
+}
+
+static char temp_path[64];
+
+// returns fd our side uses, peer is started for pipes and sockets
+static int open_transport(BENCH_TRANSPORT transport, int reading,
+			  const char *data, BENCH_PEER *peer)
+{
+	peer->fd = -1;
+	if (transport == BENCH_FILE) {
+		strcpy(temp_path, "/tmp/eli_stream_benchXXXXXX");
+		int fd = mkstemp(temp_path);
+		if (fd < 0) {
+			return -1;
+		}
+		if (reading) {
+			size_t offset = 0;
+			while (offset < total_size) {
+				ssize_t res = write(fd, data + offset,
+						    total_size - offset);
+				if (res <= 0) {
+					close(fd);
+					return -1;
+				}
+				offset += res;
+			}
+			lseek(fd, 0, SEEK_SET);
+		}
+		return fd;
+	}
+
+	int fds[2];
+	int res = transport == BENCH_PIPE ?
+			  pipe(fds) :
+			  socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+	if (res != 0) {
+		return -1;
+	}
+	// pipes read on fds[0] and write on fds[1], sockets either way
+	int own = reading ? fds[0] : fds[1];
+	peer->fd = reading ? fds[1] : fds[0];
+	peer->data = reading ? data : NULL;
+	pthread_create(&peer->thread, NULL, run_peer, peer);
+	return own;
+}
+
+static void close_transport(BENCH_TRANSPORT transport, BENCH_PEER *peer)
+{
+	if (peer->fd >= 0) {
+		pthread_join(peer->thread, NULL);
+	}
+	if (transport == BENCH_FILE) {
+		unlink(temp_path);
+	}
+}
+
+static int is_read_op(BENCH_OP op)
+{
+	return op != BENCH_WRITE;
+}
+
+// runs one operation with the stream or io file at stack index 1, the
+// io read/write function is at index 2, returns bytes moved, 0 on EOF
+static size_t run_op(lua_State *L, BENCH_IMPL impl, const BENCH_CASE *c,
+		     const char *chunk, int timeout_ms)
+{
+	int top = lua_gettop(L);
+	if (impl == BENCH_LUA_IO) {
+		lua_pushvalue(L, 2);
+		lua_pushvalue(L, 1);
+		switch (c->op) {
+		case BENCH_READ_LINE:
+			lua_pushliteral(L, "l");
+			break;
+		case BENCH_READ_LINE_KEEP:
+			lua_pushliteral(L, "L");
+			break;
+		case BENCH_READ_ALL:
+			lua_pushliteral(L, "a");
+			break;
+		case BENCH_READ_BYTES:
+			lua_pushinteger(L, (lua_Integer)c->size);
+			break;
+		case BENCH_WRITE:
+			lua_pushlstring(L, chunk, c->size);
+			break;
+		}
+		lua_call(L, 2, 1);
+	} else {
+		ELI_STREAM *stream = (ELI_STREAM *)lua_touserdata(L, 1);
+		switch (c->op) {
+		case BENCH_READ_LINE:
+			stream_read(L, 1, "l", timeout_ms);
+			break;
+		case BENCH_READ_LINE_KEEP:
+			stream_read(L, 1, "L", timeout_ms);
+			break;
+		case BENCH_READ_ALL:
+			stream_read(L, 1, "a", timeout_ms);
+			break;
+		case BENCH_READ_BYTES:
+			stream_read_bytes(L, 1, c->size, timeout_ms);
+			break;
+		case BENCH_WRITE:
+			stream_write(L, stream, chunk, c->size);
+			break;
+		}
+	}
+	size_t moved = 0;
+	if (c->op == BENCH_WRITE) {
+		moved = lua_isnil(L, top + 1) ? 0 : c->size;
+	} else if (lua_type(L, top + 1) == LUA_TSTRING) {
+		moved = lua_rawlen(L, top + 1);
+		if (moved == 0 && c->op != BENCH_READ_LINE) {
+			moved = 1; // empty read("a") before EOF, keep going
+		} else if (c->op == BENCH_READ_LINE) {
+			moved++; // the chopped '\n'
+		}
+	}
+	lua_settop(L, top);
+	return moved;
+}
+
+static int push_target(lua_State *L, BENCH_IMPL impl, int fd, int reading,
+		       int nonblocking)
+{
+	if (impl == BENCH_LUA_IO) {
+		// only regular files, io can not wrap an existing fd
+		lua_getglobal(L, "io");
+		lua_getfield(L, -1, "open");
+		lua_pushstring(L, temp_path);
+		lua_pushstring(L, reading ? "rb" : "wb");
+		lua_call(L, 2, 1);
+		lua_remove(L, -2);
+		close(fd);
+		if (lua_isnil(L, -1)) {
+			return 0;
+		}
+		lua_getfield(L, -1, reading ? "read" : "write");
+		return 1;
+	}
+	ELI_STREAM *stream = eli_new_stream(L);
+	stream->fd = fd;
+	stream->nonblocking = nonblocking;
+	luaL_setmetatable(L, reading ? ELI_STREAM_R_METATABLE :
+				       ELI_STREAM_W_METATABLE);
+	lua_pushnil(L);
+	return 1;
+}
+
+static void close_target(lua_State *L, BENCH_IMPL impl)
+{
+	if (impl == BENCH_LUA_IO) {
+		lua_getfield(L, 1, "close");
+		lua_pushvalue(L, 1);
+		lua_call(L, 1, 0);
+	} else {
+		eli_stream_close((ELI_STREAM *)lua_touserdata(L, 1));
+	}
+	lua_settop(L, 0);
+}
+
+static void run_case(lua_State *L, BENCH_IMPL impl, BENCH_TRANSPORT transport,
+		     const BENCH_CASE *c, int nonblocking)
+{
+	char name[96];
+	const char *op_names[] = { "read l", "read L", "read a", "read n",
+				   "write" };
+	snprintf(name, sizeof(name), "%s %-6s %-6s %-5zu %s",
+		 impl == BENCH_ELI ? "eli" : "io ", transport_names[transport],
+		 op_names[c->op], c->size,
+		 nonblocking ? "nonblocking" : "blocking");
+	if (filter != NULL && strstr(name, filter) == NULL) {
+		return;
+	}
+
+	int reading = is_read_op(c->op);
+	char *data = create_data(c->op == BENCH_READ_LINE ||
+						 c->op == BENCH_READ_LINE_KEEP ?
+					 c->size :
+					 0);
+	BENCH_PEER peer;
+	int fd = open_transport(transport, reading, data, &peer);
+	if (fd < 0 || !push_target(L, impl, fd, reading, nonblocking)) {
+		fprintf(stderr, "%s: failed to open: %s\n", name,
+			strerror(errno));
+		free(data);
+		lua_settop(L, 0);
+		return;
+	}
+	// nonblocking streams poll with a timeout, blocking wait forever
+	int timeout_ms = nonblocking ? BENCH_TIMEOUT_MS : -1;
+
+	BENCH_RESULT result;
+	memset(&result, 0, sizeof(result));
+	long long syscalls = syscalls_begin();
+	long long start = now_ns();
+	while (result.bytes < total_size) {
+		long long t = now_ns();
+		size_t moved = run_op(L, impl, c, data, timeout_ms);
+		add_sample(&result, now_ns() - t);
+		if (moved == 0) {
+			break;
+		}
+		result.bytes += moved;
+	}
+	if (impl == BENCH_ELI && !reading) {
+		stream_flush((ELI_STREAM *)lua_touserdata(L, 1));
+	}
+	result.seconds = (now_ns() - start) / 1e9;
+	result.syscalls = syscalls_end(syscalls);
+	close_target(L, impl);
+	close_transport(transport, &peer);
+
+	qsort(result.samples, result.ops, sizeof(long long), compare_samples);
+	printf("%-40s %10.1f %12.0f %9lld %9lld %9lld ", name,
+	       result.bytes / result.seconds / (1024 * 1024),
+	       result.ops / result.seconds, percentile(&result, 0.5),
+	       percentile(&result, 0.9), percentile(&result, 0.99));
+	if (result.syscalls < 0 || result.ops == 0) {
+		printf("%10s\n", "-");
+	} else {
+		printf("%10.3f\n", (double)result.syscalls / result.ops);
+	}
+	fflush(stdout);
+	free(result.samples);
+	free(data);
+}
+
+int main(int argc, char **argv)
+{
+	size_t size_mb = BENCH_DEFAULT_SIZE_MB;
+	int opt;
+	while ((opt = getopt(argc, argv, "s:f:")) != -1) {
+		switch (opt) {
+		case 's':
+			size_mb = strtoul(optarg, NULL, 10);
+			break;
+		case 'f':
+			filter = optarg;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-s size_mb] [-f filter]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+	total_size = (size_mb > 0 ? size_mb : 1) * 1024 * 1024;
+	open_syscall_counter();
+
+	lua_State *L = luaL_newstate();
+	luaL_openlibs(L);
+	luaL_requiref(L, "eli.stream.extra", luaopen_eli_stream_extra, 0);
+	lua_settop(L, 0);
+
+	printf("%zu MiB per case, syscalls counted: %s\n", size_mb,
+	       syscall_source);
+	printf("%-40s %10s %12s %9s %9s %9s %10s\n", "case", "MiB/s", "ops/s",
+	       "p50 ns", "p90 ns", "p99 ns", "sys/op");
+	for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+		for (int t = BENCH_PIPE; t <= BENCH_SOCKET; t++) {
+			for (int nonblocking = 0; nonblocking <= 1;
+			     nonblocking++) {
+				run_case(L, BENCH_ELI, t, &cases[i],
+					 nonblocking);
+			}
+		}
+		run_case(L, BENCH_LUA_IO, BENCH_FILE, &cases[i], 0);
+	}
+	lua_close(L);
+	return 0;
+}
@@ -0,0 +1,159 @@
+#include "lua.h"
+#include "lauxlib.h"
+#include <string.h>
+#include "lbuffer.h"
+
+ELI_STREAM_BYTE_BUFFER *to_byte_buffer(lua_State *L, int idx)
+{
+	return (ELI_STREAM_BYTE_BUFFER *)luaL_testudata(
+		L, idx, ELI_STREAM_BYTE_BUFFER_METATABLE);
+}
+
+static ELI_STREAM_BYTE_BUFFER *check_byte_buffer(lua_State *L, int idx)
+{
+	return (ELI_STREAM_BYTE_BUFFER *)luaL_checkudata(
+		L, idx, ELI_STREAM_BYTE_BUFFER_METATABLE);
+}
+
+// translates negative positions the way string.sub does
+static size_t get_position(lua_Integer pos, size_t length)
+{
+	if (pos > 0) {
+		return (size_t)pos;
+	}
+	if (pos == 0) {
+		return 1;
+	}
+	if (pos < -(lua_Integer)length) {
+		return 1;
+	}
+	return length + (size_t)pos + 1;
+}
+
+void check_byte_buffer_range(lua_State *L, ELI_STREAM_BYTE_BUFFER *buffer,
+			     int i_idx, size_t *start, size_t *length)
+{
+	size_t i = get_position(luaL_optinteger(L, i_idx, 1), buffer->length);
+	lua_Integer j_arg = luaL_optinteger(L, i_idx + 1, -1);
+	size_t j = j_arg < -(lua_Integer)buffer->length ?
+			   0 :
+			   get_position(j_arg, buffer->length);
+	if (j > buffer->length) {
+		j = buffer->length;
+	}
+	*start = i > j ? 0 : i - 1;
+	*length = i > j ? 0 : j - i + 1;
+}
+
+static int lbyte_buffer_len(lua_State *L)
+{
+	ELI_STREAM_BYTE_BUFFER *buffer = check_byte_buffer(L, 1);
+	lua_pushinteger(L, (lua_Integer)buffer->length);
+	return 1;
+}
+
+static int lbyte_buffer_capacity(lua_State *L)
+{
+	ELI_STREAM_BYTE_BUFFER *buffer = check_byte_buffer(L, 1);
+	lua_pushinteger(L, (lua_Integer)buffer->capacity);
+	return 1;
+}
+
+// tostring([i], [j]) copies the data out, only here a lua string is made
+static int lbyte_buffer_tostring(lua_State *L)
+{
+	ELI_STREAM_BYTE_BUFFER *buffer = check_byte_buffer(L, 1);
+	size_t start, length;
+	check_byte_buffer_range(L, buffer, 2, &start, &length);
+	lua_pushlstring(L, buffer->data + start, length);
+	return 1;
+}
+
+static int lbyte_buffer_byte(lua_State *L)
+{
+	ELI_STREAM_BYTE_BUFFER *buffer = check_byte_buffer(L, 1);
+	size_t pos = get_position(luaL_optinteger(L, 2, 1), buffer->length);
+	if (pos > buffer->length) {
+		return 0;
+	}
+	lua_pushinteger(L, (unsigned char)buffer->data[pos - 1]);
+	return 1;
+}
+
+// set(s, [offset]) copies s into the buffer at offset, by default it is
+// appended, the length grows to cover it
+static int lbyte_buffer_set(lua_State *L)
+{
+	ELI_STREAM_BYTE_BUFFER *buffer = check_byte_buffer(L, 1);
+	size_t size;
+	const char *data = luaL_checklstring(L, 2, &size);
+	lua_Integer offset =
+		luaL_optinteger(L, 3, (lua_Integer)buffer->length + 1);
+	luaL_argcheck(L, offset >= 1 && (size_t)offset <= buffer->length + 1,
+		      3, "offset out of range");
+	luaL_argcheck(L, size <= buffer->capacity - (size_t)(offset - 1), 2,
+		      "data does not fit into the buffer");
+	memcpy(buffer->data + offset - 1, data, size);
+	if ((size_t)offset - 1 + size > buffer->length) {
+		buffer->length = (size_t)offset - 1 + size;
+	}
+	lua_pushinteger(L, (lua_Integer)buffer->length);
+	return 1;
+}
+
+static int lbyte_buffer_clear(lua_State *L)
+{
+	ELI_STREAM_BYTE_BUFFER *buffer = check_byte_buffer(L, 1);
+	buffer->length = 0;
+	return 0;
+}
+
+// new_buffer(capacity), the data lives inside the userdata so a buffer is
+// a single allocation for its whole life
+int lbyte_buffer_new(lua_State *L)
+{
+	lua_Integer capacity = luaL_checkinteger(L, 1);
+	luaL_argcheck(L, capacity > 0, 1, "capacity must be > 0");
+	ELI_STREAM_BYTE_BUFFER *buffer = lua_newuserdatauv(
+		L, sizeof(ELI_STREAM_BYTE_BUFFER) + (size_t)capacity, 0);
+	buffer->length = 0;
+	buffer->capacity = (size_t)capacity;
+	luaL_setmetatable(L, ELI_STREAM_BYTE_BUFFER_METATABLE);
+	return 1;
+}
+
+int create_byte_buffer_meta(lua_State *L)
+{
+	luaL_newmetatable(L, ELI_STREAM_BYTE_BUFFER_METATABLE);
+
+	/* Method table */
+	lua_newtable(L);
+	lua_pushcfunction(L, lbyte_buffer_len);
+	lua_setfield(L, -2, "len");
+	lua_pushcfunction(L, lbyte_buffer_capacity);
+	lua_setfield(L, -2, "capacity");
+	lua_pushcfunction(L, lbyte_buffer_tostring);
+	lua_setfield(L, -2, "tostring");
+	lua_pushcfunction(L, lbyte_buffer_tostring);
+	lua_setfield(L, -2, "sub");
+	lua_pushcfunction(L, lbyte_buffer_byte);
+	lua_setfield(L, -2, "byte");
+	lua_pushcfunction(L, lbyte_buffer_set);
+	lua_setfield(L, -2, "set");
+	lua_pushcfunction(L, lbyte_buffer_clear);
+	lua_setfield(L, -2, "clear");
+
+	lua_pushstring(L, ELI_STREAM_BYTE_BUFFER_METATABLE);
+	lua_setfield(L, -2, "__type");
+
+	/* Metamethods */
+	lua_setfield(L, -2, "__index");
+
+	lua_pushcfunction(L, lbyte_buffer_len);
+	lua_setfield(L, -2, "__len");
+
+	lua_pushcfunction(L, lbyte_buffer_tostring);
+	lua_setfield(L, -2, "__tostring");
+
+	return 1;
+}
@@ -0,0 +1,25 @@
+#ifndef ELI_LBUFFER_EXTRA_H__
+#define ELI_LBUFFER_EXTRA_H__
+
+#include <stddef.h>
+#include "lua.h"
+
+#define ELI_STREAM_BYTE_BUFFER_METATABLE "ELI_STREAM_BYTE_BUFFER"
+
+// fixed capacity byte buffer, data[0, length) is valid
+typedef struct ELI_STREAM_BYTE_BUFFER {
+	size_t length;
+	size_t capacity;
+	char data[];
+} ELI_STREAM_BYTE_BUFFER;
+
+// returns NULL if the value at idx is not a byte buffer
+ELI_STREAM_BYTE_BUFFER *to_byte_buffer(lua_State *L, int idx);
+// resolves optional 1 based inclusive i, j at i_idx and i_idx + 1 with
+// string.sub rules, defaults cover the whole buffer
+void check_byte_buffer_range(lua_State *L, ELI_STREAM_BYTE_BUFFER *buffer,
+			     int i_idx, size_t *start, size_t *length);
+int lbyte_buffer_new(lua_State *L);
+int create_byte_buffer_meta(lua_State *L);
+
+#endif
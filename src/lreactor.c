@@ -0,0 +1,531 @@
+#include "lua.h"
+#include "lauxlib.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lerror.h"
+#include "lsleep.h"
+#include "stream.h"
+#include "lstream.h"
+#include "lreactor.h"
+#include "stream_uring.h"
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#define REACTOR_DEFAULT_MAX_EVENTS 64
+#define REACTOR_URING_ENTRIES 64
+#define REACTOR_PREFETCH_SIZE (16 * 1024)
+
+typedef struct ELI_STREAM_REACTOR_ENTRY {
+	ELI_STREAM *stream; // NULL if the slot is not used
+	uint32_t events;
+	uint32_t token; // of the registration, see get_event_entry
+	unsigned mark; // wait_mark of the wait which got an event for it
+} ELI_STREAM_REACTOR_ENTRY;
+
+typedef struct ELI_STREAM_REACTOR {
+	int fd;
+	int closed;
+	// registered streams indexed by their fd, the stream objects are kept
+	// alive by the fd -> stream table in uservalue 1
+	ELI_STREAM_REACTOR_ENTRY *entries;
+	int entries_size;
+	// readable streams with buffered data, kept up by the streams
+	ELI_STREAM_READY_LIST ready;
+	unsigned wait_mark;
+	uint32_t last_token;
+	struct epoll_event *events;
+	int events_size;
+#ifdef ELI_STREAM_URING_SUPPORTED
+	// if set, readable streams are read in one batch after each wait
+	ELI_STREAM_URING *uring;
+	ELI_STREAM **prefetch;
+	int prefetch_size;
+#endif
+} ELI_STREAM_REACTOR;
+
+static int ensure_entries(ELI_STREAM_REACTOR *reactor, int fd)
+{
+	if (fd < reactor->entries_size) {
+		return 1;
+	}
+	int size = reactor->entries_size == 0 ? 64 : reactor->entries_size;
+	while (size <= fd) {
+		size *= 2;
+	}
+	ELI_STREAM_REACTOR_ENTRY *entries =
+		realloc(reactor->entries, sizeof(*entries) * size);
+	if (entries == NULL) {
+		return 0;
+	}
+	memset(entries + reactor->entries_size, 0,
+	       sizeof(*entries) * (size - reactor->entries_size));
+	reactor->entries = entries;
+	reactor->entries_size = size;
+	return 1;
+}
+
+// the event data carries the fd and the token of its registration, so an
+// event of an earlier registration of the fd is not taken for the current
+// one, returns NULL for such events
+static ELI_STREAM_REACTOR_ENTRY *get_event_entry(ELI_STREAM_REACTOR *reactor,
+						 const struct epoll_event *event)
+{
+	int fd = (int)(uint32_t)event->data.u64;
+	uint32_t token = (uint32_t)(event->data.u64 >> 32);
+	if (fd >= reactor->entries_size) {
+		return NULL;
+	}
+	ELI_STREAM_REACTOR_ENTRY *entry = &reactor->entries[fd];
+	if (entry->stream == NULL || entry->stream->closed ||
+	    entry->token != token) {
+		return NULL;
+	}
+	return entry;
+}
+
+// interest defaults to whatever the stream kind supports
+static uint32_t get_interest(lua_State *L, int idx, ELI_STREAM_KIND kind)
+{
+	int readable = kind == ELI_STREAM_R_KIND || kind == ELI_STREAM_RW_KIND;
+	int writable = kind == ELI_STREAM_W_KIND || kind == ELI_STREAM_RW_KIND;
+	if (lua_isnoneornil(L, idx)) {
+		return (readable ? EPOLLIN : 0) | (writable ? EPOLLOUT : 0);
+	}
+	const char *interest = luaL_checkstring(L, idx);
+	uint32_t events = 0;
+	for (; *interest; interest++) {
+		switch (*interest) {
+		case 'r':
+			luaL_argcheck(L, readable, idx,
+				      "stream is not readable");
+			events |= EPOLLIN;
+			break;
+		case 'w':
+			luaL_argcheck(L, writable, idx,
+				      "stream is not writable");
+			events |= EPOLLOUT;
+			break;
+		default:
+			luaL_argerror(L, idx, "invalid interest");
+		}
+	}
+	luaL_argcheck(L, events != 0, idx, "invalid interest");
+	return events;
+}
+
+static int lreactor_register(lua_State *L)
+{
+	static const char *const modes[] = { "level", "edge", NULL };
+
+	ELI_STREAM_REACTOR *reactor = (ELI_STREAM_REACTOR *)luaL_checkudata(
+		L, 1, ELI_STREAM_REACTOR_METATABLE);
+	if (reactor->closed) {
+		errno = EBADF;
+		return push_error(L, "Reactor is closed!");
+	}
+	ELI_STREAM_KIND kind = get_stream_kind(L, 2);
+	if (kind == ELI_STREAM_INVALID_KIND) {
+		return luaL_argerror(L, 2, "ELI_STREAM expected");
+	}
+	ELI_STREAM *stream = (ELI_STREAM *)lua_touserdata(L, 2);
+	if (stream->closed) {
+		errno = EBADF;
+		return push_error(L, "Stream is closed!");
+	}
+	uint32_t events = get_interest(L, 3, kind);
+	if (luaL_checkoption(L, 4, "level", modes) == 1) {
+		events |= EPOLLET;
+	}
+
+	if (!ensure_entries(reactor, stream->fd)) {
+		return luaL_error(L, "not enough memory");
+	}
+	uint32_t token = ++reactor->last_token;
+	struct epoll_event ev = {
+		.events = events,
+		.data.u64 = ((uint64_t)token << 32) | (uint32_t)stream->fd
+	};
+	if (epoll_ctl(reactor->fd, EPOLL_CTL_ADD, stream->fd, &ev) == -1) {
+		if (errno != EEXIST ||
+		    epoll_ctl(reactor->fd, EPOLL_CTL_MOD, stream->fd, &ev) ==
+			    -1) {
+			return push_error(L, "Failed to register stream!");
+		}
+	}
+	// the slot may still hold a closed stream which had the fd before
+	// streams sharing the fd (filters) do not own the registration anymore
+	ELI_STREAM *previous = reactor->entries[stream->fd].stream;
+	if (previous != NULL && previous != stream) {
+		if (previous->ready_list == &reactor->ready) {
+			stream_set_ready_list(previous, NULL);
+		}
+		if (previous->reactor_fd == reactor->fd) {
+			previous->reactor_fd = -1;
+		}
+	}
+	reactor->entries[stream->fd].stream = stream;
+	reactor->entries[stream->fd].events = events;
+	reactor->entries[stream->fd].token = token;
+	stream->reactor_fd = reactor->fd;
+	if (events & EPOLLIN) {
+		stream_set_ready_list(stream, &reactor->ready);
+	} else if (stream->ready_list == &reactor->ready) {
+		stream_set_ready_list(stream, NULL);
+	}
+
+	lua_getiuservalue(L, 1, 1);
+	lua_pushvalue(L, 2);
+	lua_rawseti(L, -2, stream->fd);
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int lreactor_unregister(lua_State *L)
+{
+	ELI_STREAM_REACTOR *reactor = (ELI_STREAM_REACTOR *)luaL_checkudata(
+		L, 1, ELI_STREAM_REACTOR_METATABLE);
+	if (reactor->closed) {
+		errno = EBADF;
+		return push_error(L, "Reactor is closed!");
+	}
+	if (get_stream_kind(L, 2) == ELI_STREAM_INVALID_KIND) {
+		return luaL_argerror(L, 2, "ELI_STREAM expected");
+	}
+	ELI_STREAM *stream = (ELI_STREAM *)lua_touserdata(L, 2);
+	// closed streams lost their fd and removed their registration on
+	// close, so we have to look them up by address
+	int fd = -1;
+	if (!stream->closed) {
+		if (stream->fd < reactor->entries_size &&
+		    reactor->entries[stream->fd].stream == stream) {
+			fd = stream->fd;
+		}
+	} else {
+		for (int i = 0; i < reactor->entries_size; i++) {
+			if (reactor->entries[i].stream == stream) {
+				fd = i;
+				break;
+			}
+		}
+	}
+	if (fd == -1) {
+		lua_pushboolean(L, 0);
+		return 1;
+	}
+	if (!stream->closed &&
+	    epoll_ctl(reactor->fd, EPOLL_CTL_DEL, fd, NULL) == -1 &&
+	    errno != ENOENT && errno != EBADF) {
+		return push_error(L, "Failed to unregister stream!");
+	}
+	if (stream->ready_list == &reactor->ready) {
+		stream_set_ready_list(stream, NULL);
+	}
+	if (stream->reactor_fd == reactor->fd) {
+		stream->reactor_fd = -1;
+	}
+	reactor->entries[fd].stream = NULL;
+	reactor->entries[fd].events = 0;
+
+	lua_getiuservalue(L, 1, 1);
+	lua_pushnil(L);
+	lua_rawseti(L, -2, fd);
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int has_buffered_data(ELI_STREAM_REACTOR_ENTRY *entry)
+{
+	return entry->stream != NULL && (entry->events & EPOLLIN) &&
+	       !entry->stream->closed &&
+	       stream_buffer_length(&entry->stream->pending) > 0;
+}
+
+static void push_event(lua_State *L, int streams_idx, int fd, int readable,
+		       int writable, int hangup)
+{
+	lua_createtable(L, 0, 4);
+	lua_rawgeti(L, streams_idx, fd);
+	lua_setfield(L, -2, "stream");
+	lua_pushboolean(L, readable);
+	lua_setfield(L, -2, "readable");
+	lua_pushboolean(L, writable);
+	lua_setfield(L, -2, "writable");
+	lua_pushboolean(L, hangup);
+	lua_setfield(L, -2, "hangup");
+}
+
+#ifdef ELI_STREAM_URING_SUPPORTED
+// reads readable streams into their pending buffers with a single syscall,
+// the following stream reads are then served without touching the fd
+static void prefetch_readable(ELI_STREAM_REACTOR *reactor, int n)
+{
+	if (reactor->prefetch_size < n) {
+		ELI_STREAM **prefetch = realloc(reactor->prefetch,
+						sizeof(ELI_STREAM *) * n);
+		if (prefetch == NULL) {
+			return;
+		}
+		reactor->prefetch = prefetch;
+		reactor->prefetch_size = n;
+	}
+	int count = 0;
+	for (int i = 0; i < n; i++) {
+		if (!(reactor->events[i].events & EPOLLIN)) {
+			continue;
+		}
+		ELI_STREAM_REACTOR_ENTRY *entry =
+			get_event_entry(reactor, &reactor->events[i]);
+		if (entry == NULL || !(entry->events & EPOLLIN) ||
+		    !stream_reads_fd_directly(entry->stream)) {
+			continue;
+		}
+		reactor->prefetch[count++] = entry->stream;
+	}
+	if (count > 0 && stream_uring_fill(reactor->uring, reactor->prefetch,
+					   count, REACTOR_PREFETCH_SIZE) == -1) {
+		// the ring is broken, keep going with plain reads
+		stream_uring_close(reactor->uring);
+		free(reactor->uring);
+		reactor->uring = NULL;
+	}
+}
+#endif
+
+static int lreactor_wait(lua_State *L)
+{
+	ELI_STREAM_REACTOR *reactor = (ELI_STREAM_REACTOR *)luaL_checkudata(
+		L, 1, ELI_STREAM_REACTOR_METATABLE);
+	if (reactor->closed) {
+		errno = EBADF;
+		return push_error(L, "Reactor is closed!");
+	}
+	double timeout = (double)luaL_optnumber(L, 2, -1);
+	if (timeout < -1) {
+		return luaL_argerror(L, 2, "timeout must be >= 0 or nil");
+	}
+	lua_Integer max_events =
+		luaL_optinteger(L, 3, REACTOR_DEFAULT_MAX_EVENTS);
+	luaL_argcheck(L, max_events > 0 && max_events <= INT32_MAX, 3,
+		      "max_events must be > 0");
+	double divider = get_ms_divider_from_state(L, 4, 1.0);
+	long long deadline =
+		stream_get_deadline(timeout < 0 ? -1 : (int)(timeout / divider));
+
+	if (reactor->events_size < max_events) {
+		struct epoll_event *events = realloc(
+			reactor->events, sizeof(*events) * (size_t)max_events);
+		if (events == NULL) {
+			return luaL_error(L, "not enough memory");
+		}
+		reactor->events = events;
+		reactor->events_size = (int)max_events;
+	}
+
+	// data already buffered in a stream does not wake up epoll
+	int buffered = reactor->ready.count;
+
+	int n;
+	do {
+		int remaining =
+			buffered > 0 ? 0 : stream_get_remaining_ms(deadline);
+		n = epoll_wait(reactor->fd, reactor->events, (int)max_events,
+			       remaining);
+	} while (n == -1 && errno == EINTR);
+	if (n == -1) {
+		return push_error(L, "Failed to wait for events!");
+	}
+
+#ifdef ELI_STREAM_URING_SUPPORTED
+	if (reactor->uring != NULL && n > 0) {
+		prefetch_readable(reactor, n);
+	}
+#endif
+
+	lua_getiuservalue(L, 1, 1);
+	int streams_idx = lua_gettop(L);
+	lua_createtable(L, n + buffered, 0);
+	int count = 0;
+	unsigned mark = ++reactor->wait_mark;
+	for (int i = 0; i < n; i++) {
+		uint32_t events = reactor->events[i].events;
+		ELI_STREAM_REACTOR_ENTRY *entry =
+			get_event_entry(reactor, &reactor->events[i]);
+		if (entry == NULL) {
+			continue; // stale event of a closed or replaced stream
+		}
+		int fd = entry->stream->fd;
+		entry->mark = mark;
+		int readable = (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) != 0 ||
+			       has_buffered_data(entry);
+		int writable = (events & (EPOLLOUT | EPOLLERR)) != 0;
+		push_event(L, streams_idx, fd, readable, writable,
+			   (events & EPOLLHUP) != 0);
+		lua_rawseti(L, -2, ++count);
+	}
+	// the streams with an event were reported above
+	for (ELI_STREAM *stream = reactor->ready.head;
+	     stream != NULL && count < max_events;
+	     stream = stream->ready_next) {
+		if (reactor->entries[stream->fd].mark != mark) {
+			push_event(L, streams_idx, stream->fd, 1, 0, 0);
+			lua_rawseti(L, -2, ++count);
+		}
+	}
+	if (count == 0) {
+		lua_pushliteral(L, "timeout");
+		return 2;
+	}
+	return 1;
+}
+
+static int lreactor_close(lua_State *L)
+{
+	ELI_STREAM_REACTOR *reactor = (ELI_STREAM_REACTOR *)luaL_checkudata(
+		L, 1, ELI_STREAM_REACTOR_METATABLE);
+	if (reactor->closed) {
+		return 0;
+	}
+	reactor->closed = 1;
+#ifdef ELI_STREAM_URING_SUPPORTED
+	if (reactor->uring != NULL) {
+		stream_uring_close(reactor->uring);
+		free(reactor->uring);
+		reactor->uring = NULL;
+	}
+	free(reactor->prefetch);
+	reactor->prefetch = NULL;
+	reactor->prefetch_size = 0;
+#endif
+	// the streams may outlive the reactor, its list and its fd
+	for (int i = 0; i < reactor->entries_size; i++) {
+		ELI_STREAM *stream = reactor->entries[i].stream;
+		if (stream == NULL) {
+			continue;
+		}
+		if (stream->ready_list == &reactor->ready) {
+			stream_set_ready_list(stream, NULL);
+		}
+		if (stream->reactor_fd == reactor->fd) {
+			stream->reactor_fd = -1;
+		}
+	}
+	free(reactor->entries);
+	reactor->entries = NULL;
+	reactor->entries_size = 0;
+	free(reactor->events);
+	reactor->events = NULL;
+	reactor->events_size = 0;
+	if (reactor->fd != -1 && close(reactor->fd) == -1) {
+		reactor->fd = -1;
+		return push_error(L, "Failed to close reactor!");
+	}
+	reactor->fd = -1;
+	return 0;
+}
+
+static int lreactor_backend(lua_State *L)
+{
+#ifdef ELI_STREAM_URING_SUPPORTED
+	ELI_STREAM_REACTOR *reactor = (ELI_STREAM_REACTOR *)luaL_checkudata(
+		L, 1, ELI_STREAM_REACTOR_METATABLE);
+	if (reactor->uring != NULL) {
+		lua_pushliteral(L, "io_uring");
+		return 1;
+	}
+#else
+	luaL_checkudata(L, 1, ELI_STREAM_REACTOR_METATABLE);
+#endif
+	lua_pushliteral(L, "epoll");
+	return 1;
+}
+
+int lreactor_new(lua_State *L)
+{
+	// options are read before the reactor is pushed over them
+	int use_io_uring = 0;
+	if (!lua_isnoneornil(L, 1)) {
+		luaL_checktype(L, 1, LUA_TTABLE);
+		lua_getfield(L, 1, "io_uring");
+		use_io_uring = lua_toboolean(L, -1);
+		lua_pop(L, 1);
+	}
+
+	ELI_STREAM_REACTOR *reactor =
+		lua_newuserdatauv(L, sizeof(ELI_STREAM_REACTOR), 1);
+	memset(reactor, 0, sizeof(ELI_STREAM_REACTOR));
+	reactor->fd = -1;
+	reactor->closed = 1; // until the epoll fd exists
+	luaL_setmetatable(L, ELI_STREAM_REACTOR_METATABLE);
+
+	lua_newtable(L);
+	lua_setiuservalue(L, -2, 1);
+
+	reactor->fd = epoll_create1(EPOLL_CLOEXEC);
+	if (reactor->fd == -1) {
+		return push_error(L, "Failed to create reactor!");
+	}
+	reactor->closed = 0;
+
+#ifdef ELI_STREAM_URING_SUPPORTED
+	// io_uring is an optimization, if it is unavailable we stay on epoll
+	if (use_io_uring) {
+		reactor->uring = malloc(sizeof(ELI_STREAM_URING));
+		if (reactor->uring != NULL &&
+		    !stream_uring_init(reactor->uring, REACTOR_URING_ENTRIES)) {
+			free(reactor->uring);
+			reactor->uring = NULL;
+		}
+	}
+#else
+	(void)use_io_uring;
+#endif
+	return 1;
+}
+
+int create_reactor_meta(lua_State *L)
+{
+	luaL_newmetatable(L, ELI_STREAM_REACTOR_METATABLE);
+
+	/* Method table */
+	lua_newtable(L);
+	lua_pushcfunction(L, lreactor_register);
+	lua_setfield(L, -2, "register");
+	lua_pushcfunction(L, lreactor_unregister);
+	lua_setfield(L, -2, "unregister");
+	lua_pushcfunction(L, lreactor_wait);
+	lua_setfield(L, -2, "wait");
+	lua_pushcfunction(L, lreactor_backend);
+	lua_setfield(L, -2, "backend");
+	lua_pushcfunction(L, lreactor_close);
+	lua_setfield(L, -2, "close");
+
+	lua_pushstring(L, ELI_STREAM_REACTOR_METATABLE);
+	lua_setfield(L, -2, "__type");
+
+	/* Metamethods */
+	lua_setfield(L, -2, "__index");
+
+	lua_pushcfunction(L, lreactor_close);
+	lua_setfield(L, -2, "__close");
+
+	lua_pushcfunction(L, lreactor_close);
+	lua_setfield(L, -2, "__gc");
+
+	return 1;
+}
+#else
+int lreactor_new(lua_State *L)
+{
+	errno = ENOTSUP;
+	return push_error(L, "reactor is not supported on this platform!");
+}
+
+int create_reactor_meta(lua_State *L)
+{
+	return 0;
+}
+#endif
@@ -0,0 +1,11 @@
+#ifndef ELI_LREACTOR_EXTRA_H__
+#define ELI_LREACTOR_EXTRA_H__
+
+#include "lua.h"
+
+#define ELI_STREAM_REACTOR_METATABLE "ELI_STREAM_REACTOR"
+
+int lreactor_new(lua_State *L);
+int create_reactor_meta(lua_State *L);
+
+#endif
@@ -1,8 +1,13 @@
 #include "lua.h"
 #include "lstream.h"
+#include "lreactor.h"
+#include "lbuffer.h"
 #include "stream.h"
+#include "stream_zlib.h"
 #include "lauxlib.h"
 #include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <string.h>
 #include <ctype.h>
 #include "lerror.h"
@@ -13,87 +18,967 @@
 #else
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
 #endif
 
-static ELI_STREAM_KIND get_stream_kind(lua_State *L, int idx)
+// stream metatables carry their kind under this key, so the type check is
+// a single raw lookup instead of comparison with every stream metatable
+static const char STREAM_KIND_KEY = 'k';
+
+ELI_STREAM_KIND get_stream_kind(lua_State *L, int idx)
 {
+	if (lua_type(L, idx) != LUA_TUSERDATA || !lua_getmetatable(L, idx)) {
+		return ELI_STREAM_INVALID_KIND;
+	}
 	ELI_STREAM_KIND res = ELI_STREAM_INVALID_KIND;
-	int top = lua_gettop(L);
-	lua_getmetatable(L, idx);
-	luaL_getmetatable(L, ELI_STREAM_R_METATABLE);
-	luaL_getmetatable(L, ELI_STREAM_W_METATABLE);
-	luaL_getmetatable(L, ELI_STREAM_RW_METATABLE);
-	if (lua_rawequal(L, -3, -4)) {
-		res = ELI_STREAM_R_KIND;
+	if (lua_rawgetp(L, -1, &STREAM_KIND_KEY) == LUA_TNUMBER) {
+		res = (ELI_STREAM_KIND)lua_tointeger(L, -1);
+	}
+	lua_pop(L, 2);
+	return res;
+}
+
+static int is_stream(lua_State *L, int idx)
+{
+	return get_stream_kind(L, idx) != ELI_STREAM_INVALID_KIND;
+}
+
+static int is_readable_stream(lua_State *L, int idx)
+{
+	ELI_STREAM_KIND kind = get_stream_kind(L, idx);
+	return kind == ELI_STREAM_R_KIND || kind == ELI_STREAM_RW_KIND;
+}
+
+static int is_writable_stream(lua_State *L, int idx)
+{
+	ELI_STREAM_KIND kind = get_stream_kind(L, idx);
+	return kind == ELI_STREAM_W_KIND || kind == ELI_STREAM_RW_KIND;
+}
+
+// timeout defaults to 0 for nonblocking streams and to no timeout otherwise
+static int get_timeout_ms(lua_State *L, ELI_STREAM *stream, int idx)
+{
+	double timeout = (double)luaL_optnumber(L, idx, -1);
+	if (timeout < -1) {
+		return luaL_argerror(L, idx, "timeout must be >= 0 or nil");
+	}
+	if (timeout == -1) {
+		return stream->nonblocking ? 0 : -1;
+	}
+	double divider = get_ms_divider_from_state(L, idx + 1, 1.0);
+	return (int)(timeout / divider);
+}
+
+// yielding streams serve coroutine schedulers: an operation which would
+// block yields fd, "r" or "w" and the stream instead, and retries when the
+// coroutine is resumed, timeouts are up to the scheduler then
+static int begin_yieldable(lua_State *L, ELI_STREAM *stream)
+{
+	stream->yield_interest = 0;
+	stream->may_yield = stream->yielding && lua_isyieldable(L);
+	return stream->may_yield;
+}
+
+// operations which never yield run with the flags cleared, an operation
+// which raised an error may have left them set
+static void begin_blocking(ELI_STREAM *stream)
+{
+	stream->may_yield = 0;
+	stream->may_queue = 0;
+}
+
+static int yield_stream(lua_State *L, ELI_STREAM *stream, lua_KContext ctx,
+			lua_KFunction k)
+{
+	stream->may_yield = 0;
+#ifdef _WIN32
+	lua_pushlightuserdata(L, stream->fd);
+#else
+	lua_pushinteger(L, stream->fd);
+#endif
+	lua_pushstring(L, stream->yield_interest == 'w' ? "w" : "r");
+	lua_pushvalue(L, 1);
+	return lua_yieldk(L, 3, ctx, k);
+}
+
+// continuations below rerun the operation after a resume
+int lstream_read(lua_State *L);
+int lstream_read_until(lua_State *L);
+int lstream_read_frame(lua_State *L);
+int lstream_read_into(lua_State *L);
+int lstream_flush(lua_State *L);
+int lstream_drain(lua_State *L);
+
+static int lstream_read_k(lua_State *L, int status, lua_KContext ctx)
+{
+	(void)status;
+	lua_settop(L, (int)ctx);
+	return lstream_read(L);
+}
+
+int lstream_read(lua_State *L)
+{
+	if (!is_readable_stream(L, 1)) {
+		errno = EBADF;
+		return push_error(L, "Not valid readable stream!");
+	}
+	int stream_index = 1;
+	ELI_STREAM *stream = (ELI_STREAM *)lua_touserdata(L, stream_index);
+	if (stream->closed) {
+		errno = EBADF;
+		return push_error(L, "Stream is not readable (closed)!");
+	}
+
+	double timeout = (double)luaL_optnumber(L, 3, -1);
+	if (timeout < -1) {
+		return luaL_argerror(L, 3, "timeout must be >= 0 or nil");
+	}
+
+	double divider = get_ms_divider_from_state(L, 4, 1.0);
+	double timeout_ms = timeout / divider;
+	if (timeout == -1) {
+		timeout_ms = stream->nonblocking ? 0 : -1;
+	}
+	// arguments are checked before the operation may yield, errors raised
+	// on the way must not leave may_yield set
+	lua_Integer length = 0;
+	const char *format = NULL;
+	switch (lua_type(L, 2)) {
+	case LUA_TNUMBER:
+		length = luaL_checkinteger(L, 2);
+		luaL_argcheck(L, length >= 0, 2, "length must be >= 0");
+		break;
+	case LUA_TSTRING: {
+		format = lua_tostring(L, 2);
+		// '*' is skipped by stream_read (for compatibility)
+		char opt = format[*format == '*' ? 1 : 0];
+		luaL_argcheck(L, opt == 'l' || opt == 'L' || opt == 'a', 2,
+			      "invalid format");
+		break;
+	}
+	default:
+		return luaL_argerror(L, 2, "number or string expected");
+	}
+	int argc = lua_gettop(L);
+	if (begin_yieldable(L, stream)) {
+		timeout = timeout_ms = -1;
+	}
+
+	int res;
+	if (format == NULL) {
+		res = stream_read_bytes(L, stream_index, (size_t)length,
+					timeout < 0 ? -1 : timeout_ms);
+	} else {
+		res = stream_read(L, stream_index, format, timeout_ms);
+	}
+	stream->may_yield = 0;
+	if (res == ELI_STREAM_YIELD) {
+		return yield_stream(L, stream, argc, lstream_read_k);
+	}
+	return res;
+}
+
+static int lstream_read_into_k(lua_State *L, int status, lua_KContext ctx)
+{
+	(void)status;
+	lua_settop(L, (int)ctx);
+	return lstream_read_into(L);
+}
+
+// read_into(buffer, [offset], [n], [timeout]) reads up to n bytes into the
+// byte buffer at offset and returns their count, the buffer then ends with
+// them, nothing is allocated on the way
+int lstream_read_into(lua_State *L)
+{
+	if (!is_readable_stream(L, 1)) {
+		errno = EBADF;
+		return push_error(L, "Not valid readable stream!");
+	}
+	ELI_STREAM *stream = (ELI_STREAM *)lua_touserdata(L, 1);
+	if (stream->closed) {
+		errno = EBADF;
+		return push_error(L, "Stream is not readable (closed)!");
+	}
+	ELI_STREAM_BYTE_BUFFER *buffer = to_byte_buffer(L, 2);
+	if (buffer == NULL) {
+		return luaL_typeerror(L, 2, ELI_STREAM_BYTE_BUFFER_METATABLE);
+	}
+	lua_Integer offset = luaL_optinteger(L, 3, 1);
+	luaL_argcheck(L, offset >= 1 && (size_t)offset <= buffer->length + 1,
+		      3, "offset out of range");
+	size_t room = buffer->capacity - (size_t)(offset - 1);
+	lua_Integer n = luaL_optinteger(L, 4, (lua_Integer)room);
+	luaL_argcheck(L, n >= 0 && (size_t)n <= room, 4,
+		      "n does not fit into the buffer");
+	int timeout_ms = get_timeout_ms(L, stream, 5);
+	int argc = lua_gettop(L);
+	if (begin_yieldable(L, stream)) {
+		timeout_ms = -1;
+	}
+	size_t length;
+	int res = stream_read_into(L, stream, buffer->data + offset - 1,
+				   (size_t)n, timeout_ms, &length);
+	stream->may_yield = 0;
+	if (res == ELI_STREAM_YIELD) {
+		return yield_stream(L, stream, argc, lstream_read_into_k);
+	}
+	buffer->length = (size_t)offset - 1 + length;
+	return res;
+}
+
+static int lstream_read_until_k(lua_State *L, int status, lua_KContext ctx)
+{
+	(void)status;
+	lua_settop(L, (int)ctx);
+	return lstream_read_until(L);
+}
+
+int lstream_read_until(lua_State *L)
+{
+	if (!is_readable_stream(L, 1)) {
+		errno = EBADF;
+		return push_error(L, "Not valid readable stream!");
+	}
+	ELI_STREAM *stream = (ELI_STREAM *)lua_touserdata(L, 1);
+	if (stream->closed) {
+		errno = EBADF;
+		return push_error(L, "Stream is not readable (closed)!");
+	}
+	size_t delimiter_length;
+	const char *delimiter = luaL_checklstring(L, 2, &delimiter_length);
+	if (delimiter_length == 0) {
+		return luaL_argerror(L, 2, "delimiter must not be empty");
+	}
+	int keep = lua_toboolean(L, 3);
+	int timeout_ms = get_timeout_ms(L, stream, 4);
+	int argc = lua_gettop(L);
+	if (begin_yieldable(L, stream)) {
+		timeout_ms = -1;
+	}
+	int res = stream_read_until(L, stream, delimiter, delimiter_length,
+				    keep, timeout_ms);
+	stream->may_yield = 0;
+	if (res == ELI_STREAM_YIELD) {
+		return yield_stream(L, stream, argc, lstream_read_until_k);
+	}
+	return res;
+}
+
+#define LSTREAM_DEFAULT_MAX_FRAME_SIZE (16 * 1024 * 1024)
+
+// reads { prefix = "u32be"|"u32le"|"varint", max = ... } at idx
+static ELI_STREAM_FRAME_PREFIX get_frame_options(lua_State *L, int idx,
+						 size_t *max_size)
+{
+	static const ELI_STREAM_FRAME_PREFIX prefixes[] = {
+		ELI_STREAM_FRAME_U32BE, ELI_STREAM_FRAME_U32LE,
+		ELI_STREAM_FRAME_VARINT
+	};
+	static const char *const prefix_names[] = { "u32be", "u32le",
+						    "varint", NULL };
+
+	ELI_STREAM_FRAME_PREFIX prefix = ELI_STREAM_FRAME_U32BE;
+	*max_size = LSTREAM_DEFAULT_MAX_FRAME_SIZE;
+	if (lua_isnoneornil(L, idx)) {
+		return prefix;
+	}
+	luaL_checktype(L, idx, LUA_TTABLE);
+	if (lua_getfield(L, idx, "prefix") != LUA_TNIL) {
+		const char *name = lua_tostring(L, -1);
+		int i = 0;
+		while (name != NULL && prefix_names[i] != NULL &&
+		       strcmp(prefix_names[i], name) != 0) {
+			i++;
+		}
+		if (name == NULL || prefix_names[i] == NULL) {
+			luaL_argerror(L, idx, "invalid frame prefix");
+		}
+		prefix = prefixes[i];
+	}
+	lua_pop(L, 1);
+	if (lua_getfield(L, idx, "max") != LUA_TNIL) {
+		lua_Integer max = lua_tointeger(L, -1);
+		luaL_argcheck(L, max > 0, idx, "max must be > 0");
+		*max_size = (size_t)max;
+	}
+	lua_pop(L, 1);
+	return prefix;
+}
+
+static int lstream_read_frame_k(lua_State *L, int status, lua_KContext ctx)
+{
+	(void)status;
+	lua_settop(L, (int)ctx);
+	return lstream_read_frame(L);
+}
+
+int lstream_read_frame(lua_State *L)
+{
+	if (!is_readable_stream(L, 1)) {
+		errno = EBADF;
+		return push_error(L, "Not valid readable stream!");
+	}
+	ELI_STREAM *stream = (ELI_STREAM *)lua_touserdata(L, 1);
+	if (stream->closed) {
+		errno = EBADF;
+		return push_error(L, "Stream is not readable (closed)!");
+	}
+	size_t max_size;
+	ELI_STREAM_FRAME_PREFIX prefix = get_frame_options(L, 2, &max_size);
+	int timeout_ms = get_timeout_ms(L, stream, 3);
+	int argc = lua_gettop(L);
+	if (begin_yieldable(L, stream)) {
+		timeout_ms = -1;
+	}
+	int res = stream_read_frame(L, stream, prefix, max_size, timeout_ms);
+	stream->may_yield = 0;
+	if (res == ELI_STREAM_YIELD) {
+		return yield_stream(L, stream, argc, lstream_read_frame_k);
+	}
+	return res;
+}
+
+int lstream_write_frame(lua_State *L)
+{
+	if (!is_writable_stream(L, 1)) {
+		errno = EBADF;
+		return push_error(L, "Not valid writable stream!");
+	}
+	ELI_STREAM *stream = (ELI_STREAM *)lua_touserdata(L, 1);
+	if (stream->closed) {
+		errno = EBADF;
+		return push_error(L, "Stream is not writable (closed)!");
+	}
+	size_t size;
+	const char *data = luaL_checklstring(L, 2, &size);
+	size_t max_size;
+	ELI_STREAM_FRAME_PREFIX prefix = get_frame_options(L, 3, &max_size);
+	if (size > max_size) {
+		return luaL_argerror(L, 2, "frame is larger than max");
+	}
+	begin_blocking(stream);
+	return stream_write_frame(L, stream, prefix, data, size);
+}
+
+static int lstream_lines_iterator(lua_State *L)
+{
+	ELI_STREAM *stream =
+		(ELI_STREAM *)lua_touserdata(L, lua_upvalueindex(1));
+	if (stream->closed) {
+		return luaL_error(L, "stream is closed");
+	}
+	int chop = lua_toboolean(L, lua_upvalueindex(2));
+	int timeout_ms = (int)lua_tointeger(L, lua_upvalueindex(3));
+	begin_blocking(stream);
+	return stream_next_line(L, stream, chop, timeout_ms);
+}
+
+// lines([format], [timeout]) iterates over the lines of the stream, the
+// iterator raises an error when the timeout passes before a line is read
+int lstream_lines(lua_State *L)
+{
+	if (!is_readable_stream(L, 1)) {
+		errno = EBADF;
+		return push_error(L, "Not valid readable stream!");
+	}
+	ELI_STREAM *stream = (ELI_STREAM *)lua_touserdata(L, 1);
+	if (stream->closed) {
+		errno = EBADF;
+		return push_error(L, "Stream is not readable (closed)!");
+	}
+	const char *format = luaL_optstring(L, 2, "l");
+	if (*format == '*') {
+		format++; /* skip optional '*' (for compatibility) */
+	}
+	if ((*format != 'l' && *format != 'L') || format[1] != '\0') {
+		return luaL_argerror(L, 2, "invalid format");
+	}
+	int timeout_ms = get_timeout_ms(L, stream, 3);
+
+	lua_pushvalue(L, 1);
+	lua_pushboolean(L, *format == 'l');
+	lua_pushinteger(L, timeout_ms);
+	lua_pushcclosure(L, lstream_lines_iterator, 3);
+	return 1;
+}
+
+int lstream_read_lines(lua_State *L)
+{
+	if (!is_readable_stream(L, 1)) {
+		errno = EBADF;
+		return push_error(L, "Not valid readable stream!");
+	}
+	ELI_STREAM *stream = (ELI_STREAM *)lua_touserdata(L, 1);
+	if (stream->closed) {
+		errno = EBADF;
+		return push_error(L, "Stream is not readable (closed)!");
+	}
+	lua_Integer max_lines = luaL_checkinteger(L, 2);
+	if (max_lines <= 0) {
+		return luaL_argerror(L, 2, "max_lines must be > 0");
+	}
+	int timeout_ms = get_timeout_ms(L, stream, 3);
+	begin_blocking(stream);
+	return stream_read_lines(L, stream, (size_t)max_lines, timeout_ms);
+}
+
+int lstream_copy_to(lua_State *L)
+{
+	if (!is_readable_stream(L, 1)) {
+		errno = EBADF;
+		return push_error(L, "Not valid readable stream!");
+	}
+	ELI_STREAM *stream = (ELI_STREAM *)lua_touserdata(L, 1);
+	if (stream->closed) {
+		errno = EBADF;
+		return push_error(L, "Stream is not readable (closed)!");
+	}
+	if (!is_writable_stream(L, 2)) {
+		errno = EBADF;
+		return push_error(L, "Not valid writable stream!");
+	}
+	ELI_STREAM *destination = (ELI_STREAM *)lua_touserdata(L, 2);
+	if (destination->closed) {
+		errno = EBADF;
+		return push_error(L, "Stream is not writable (closed)!");
+	}
+
+	size_t length = SIZE_MAX;
+	if (!lua_isnoneornil(L, 3)) {
+		lua_Integer l = luaL_checkinteger(L, 3);
+		if (l < 0) {
+			return luaL_argerror(L, 3, "length must be >= 0 or nil");
+		}
+		length = (size_t)l;
+	}
+
+	int timeout_ms = get_timeout_ms(L, stream, 4);
+	begin_blocking(stream);
+	begin_blocking(destination);
+	return stream_copy(L, stream, destination, length, timeout_ms);
+}
+
+#define LSTREAM_STACK_TEE_TARGETS 8
+#define LSTREAM_DEFAULT_TEE_LIMIT (1024 * 1024)
+
+// reads { policy = "block"|"drop"|"buffer", limit = ..., length = ...,
+// timeout = ... } at idx
+static ELI_STREAM_TEE_POLICY get_tee_options(lua_State *L, int idx,
+					     ELI_STREAM *stream, size_t *limit,
+					     size_t *length, int *timeout_ms)
+{
+	static const ELI_STREAM_TEE_POLICY policies[] = {
+		ELI_STREAM_TEE_BLOCK, ELI_STREAM_TEE_DROP, ELI_STREAM_TEE_BUFFER
+	};
+	static const char *const policy_names[] = { "block", "drop", "buffer",
+						    NULL };
+
+	ELI_STREAM_TEE_POLICY policy = ELI_STREAM_TEE_BLOCK;
+	*limit = LSTREAM_DEFAULT_TEE_LIMIT;
+	*length = SIZE_MAX;
+	*timeout_ms = stream->nonblocking ? 0 : -1;
+	if (lua_isnoneornil(L, idx)) {
+		return policy;
+	}
+	luaL_checktype(L, idx, LUA_TTABLE);
+	// errors name the options table, not the field value on the stack
+	if (lua_getfield(L, idx, "policy") != LUA_TNIL) {
+		const char *name = lua_type(L, -1) == LUA_TSTRING ?
+					   lua_tostring(L, -1) :
+					   NULL;
+		int i = 0;
+		while (name != NULL && policy_names[i] != NULL &&
+		       strcmp(policy_names[i], name) != 0) {
+			i++;
+		}
+		if (name == NULL || policy_names[i] == NULL) {
+			luaL_argerror(L, idx,
+				      "policy must be block, drop or buffer");
+		}
+		policy = policies[i];
+	}
+	lua_pop(L, 1);
+	int is_integer;
+	if (lua_getfield(L, idx, "limit") != LUA_TNIL) {
+		lua_Integer l = lua_tointegerx(L, -1, &is_integer);
+		luaL_argcheck(L, is_integer && l >= 0, idx,
+			      "limit must be an integer >= 0");
+		*limit = (size_t)l;
+	}
+	lua_pop(L, 1);
+	if (lua_getfield(L, idx, "length") != LUA_TNIL) {
+		lua_Integer l = lua_tointegerx(L, -1, &is_integer);
+		luaL_argcheck(L, is_integer && l >= 0, idx,
+			      "length must be an integer >= 0");
+		*length = (size_t)l;
+	}
+	lua_pop(L, 1);
+	if (lua_getfield(L, idx, "timeout") != LUA_TNIL) {
+		int is_number;
+		lua_Number timeout = lua_tonumberx(L, -1, &is_number);
+		luaL_argcheck(L, is_number && timeout >= 0, idx,
+			      "timeout must be a number >= 0");
+		*timeout_ms = (int)timeout;
+	}
+	lua_pop(L, 1);
+	return policy;
+}
+
+// tee_to({ w1, w2, ... }, [options]) reads the stream once into all targets,
+// pipes are teed in the kernel, anything else shares one buffer, see
+// get_tee_options and ELI_STREAM_TEE_POLICY for slow targets
+int lstream_tee_to(lua_State *L)
+{
+	if (!is_readable_stream(L, 1)) {
+		errno = EBADF;
+		return push_error(L, "Not valid readable stream!");
+	}
+	ELI_STREAM *stream = (ELI_STREAM *)lua_touserdata(L, 1);
+	if (stream->closed) {
+		errno = EBADF;
+		return push_error(L, "Stream is not readable (closed)!");
+	}
+	luaL_checktype(L, 2, LUA_TTABLE);
+	size_t limit, length;
+	int timeout_ms;
+	ELI_STREAM_TEE_POLICY policy =
+		get_tee_options(L, 3, stream, &limit, &length, &timeout_ms);
+
+	int count = (int)lua_rawlen(L, 2);
+	luaL_argcheck(L, count > 0, 2, "no targets");
+	ELI_STREAM *stack_targets[LSTREAM_STACK_TEE_TARGETS];
+	ELI_STREAM **targets = stack_targets;
+	if (count > LSTREAM_STACK_TEE_TARGETS) {
+		targets = (ELI_STREAM **)lua_newuserdatauv(
+			L, sizeof(ELI_STREAM *) * count, 0);
+	}
+	for (int i = 0; i < count; i++) {
+		lua_rawgeti(L, 2, i + 1);
+		if (!is_writable_stream(L, -1)) {
+			errno = EBADF;
+			return push_error(L, "Not valid writable stream!");
+		}
+		ELI_STREAM *target = (ELI_STREAM *)lua_touserdata(L, -1);
+		lua_pop(L, 1);
+		if (target->closed) {
+			errno = EBADF;
+			return push_error(L, "Stream is not writable (closed)!");
+		}
+		luaL_argcheck(L, target != stream, 2,
+			      "the stream can not be its own target");
+		targets[i] = target;
+		begin_blocking(target);
+	}
+	begin_blocking(stream);
+	return stream_tee(L, stream, targets, count, length, policy, limit,
+			  timeout_ms);
+}
+
+#define LSTREAM_STACK_IOVEC_COUNT 16
+
+// allocates iovcnt vectors, small counts use the provided stack array
+static ELI_STREAM_IOVEC *prepare_iovecs(lua_State *L, int iovcnt,
+					ELI_STREAM_IOVEC *stack_iov)
+{
+	if (iovcnt <= LSTREAM_STACK_IOVEC_COUNT) {
+		return stack_iov;
+	}
+	return (ELI_STREAM_IOVEC *)lua_newuserdatauv(
+		L, sizeof(ELI_STREAM_IOVEC) * iovcnt, 0);
+}
+
+static int is_would_block_error(void)
+{
+	return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+// the data was queued by the yielding write, wait until it is written
+static int lstream_write_k(lua_State *L, int status, lua_KContext ctx)
+{
+	(void)status;
+	ELI_STREAM *stream = (ELI_STREAM *)lua_touserdata(L, 1);
+	size_t size = (size_t)ctx;
+	if (stream->closed) {
+		errno = EBADF;
+		return push_error(L, "Stream is not writable (closed)!");
+	}
+	if (stream_flush(stream)) {
+		lua_pushinteger(L, (lua_Integer)size);
+		return 1;
+	}
+	if (is_would_block_error() && lua_isyieldable(L)) {
+		stream->yield_interest = 'w';
+		return yield_stream(L, stream, ctx, lstream_write_k);
+	}
+	size_t unwritten = stream_buffer_length(&stream->write_buffer);
+	return stream_push_write_result(L, 0,
+					unwritten < size ? size - unwritten : 0);
+}
+
+int lstream_write(lua_State *L)
+{
+	if (!is_writable_stream(L, 1)) {
+		errno = EBADF;
+		return push_error(L, "Not valid writable stream!");
+	}
+	ELI_STREAM *stream = (ELI_STREAM *)lua_touserdata(L, 1);
+	if (stream->closed) {
+		errno = EBADF;
+		return push_error(L, "Stream is not writable (closed)!");
+	}
+	int iovcnt = lua_gettop(L) - 1;
+	ELI_STREAM_IOVEC stack_iov[LSTREAM_STACK_IOVEC_COUNT];
+	ELI_STREAM_IOVEC *iov = stack_iov;
+	ELI_STREAM_BYTE_BUFFER *buffer = to_byte_buffer(L, 2);
+	if (buffer != NULL) {
+		// write(buffer, [i], [j]) sends a slice of the byte buffer
+		size_t start, length;
+		check_byte_buffer_range(L, buffer, 3, &start, &length);
+		iov[0].iov_base = buffer->data + start;
+		iov[0].iov_len = length;
+		iovcnt = 1;
+	} else {
+		if (iovcnt == 0) {
+			luaL_checklstring(L, 2, NULL);
+		}
+		iov = prepare_iovecs(L, iovcnt, stack_iov);
+		for (int i = 0; i < iovcnt; i++) {
+			size_t size;
+			const char *data = luaL_checklstring(L, i + 2, &size);
+			iov[i].iov_base = (void *)data;
+			iov[i].iov_len = size;
+		}
+	}
+	begin_yieldable(L, stream);
+	// outside coroutines nonblocking writes queue instead of failing
+	stream->may_queue = stream->nonblocking && !stream->may_yield;
+	size_t written;
+	int status = stream_writev(stream, iov, iovcnt, &written);
+	stream->may_yield = 0;
+	stream->may_queue = 0;
+	if (status == ELI_STREAM_YIELD) {
+		return yield_stream(L, stream, (lua_KContext)written,
+				    lstream_write_k);
+	}
+	return stream_push_write_result(L, status, written);
+}
+
+int lstream_write_many(lua_State *L)
+{
+	if (!is_writable_stream(L, 1)) {
+		errno = EBADF;
+		return push_error(L, "Not valid writable stream!");
+	}
+	ELI_STREAM *stream = (ELI_STREAM *)lua_touserdata(L, 1);
+	if (stream->closed) {
+		errno = EBADF;
+		return push_error(L, "Stream is not writable (closed)!");
+	}
+	luaL_checktype(L, 2, LUA_TTABLE);
+	int iovcnt = (int)lua_rawlen(L, 2);
+	ELI_STREAM_IOVEC stack_iov[LSTREAM_STACK_IOVEC_COUNT];
+	ELI_STREAM_IOVEC *iov = prepare_iovecs(L, iovcnt, stack_iov);
+	for (int i = 0; i < iovcnt; i++) {
+		// strings stay referenced by the table while we write
+		if (lua_rawgeti(L, 2, i + 1) != LUA_TSTRING) {
+			return luaL_argerror(L, 2, "table of strings expected");
+		}
+		size_t size;
+		iov[i].iov_base = (void *)lua_tolstring(L, -1, &size);
+		iov[i].iov_len = size;
+		lua_pop(L, 1);
+	}
+	begin_yieldable(L, stream);
+	// outside coroutines nonblocking writes queue instead of failing
+	stream->may_queue = stream->nonblocking && !stream->may_yield;
+	size_t written;
+	int status = stream_writev(stream, iov, iovcnt, &written);
+	stream->may_yield = 0;
+	stream->may_queue = 0;
+	if (status == ELI_STREAM_YIELD) {
+		return yield_stream(L, stream, (lua_KContext)written,
+				    lstream_write_k);
+	}
+	return stream_push_write_result(L, status, written);
+}
+
+static int lstream_flush_k(lua_State *L, int status, lua_KContext ctx)
+{
+	(void)status;
+	lua_settop(L, (int)ctx);
+	return lstream_flush(L);
+}
+
+int lstream_flush(lua_State *L)
+{
+	if (!is_writable_stream(L, 1)) {
+		errno = EBADF;
+		return push_error(L, "Not valid writable stream!");
+	}
+	ELI_STREAM *stream = (ELI_STREAM *)lua_touserdata(L, 1);
+	if (stream->closed) {
+		errno = EBADF;
+		return push_error(L, "Stream is not writable (closed)!");
+	}
+	begin_blocking(stream);
+	if (!stream_flush(stream) || !stream_sync_filter(stream)) {
+		if (stream->yielding && is_would_block_error() &&
+		    lua_isyieldable(L)) {
+			stream->yield_interest = 'w';
+			return yield_stream(L, stream, lua_gettop(L),
+					    lstream_flush_k);
+		}
+		// outside coroutines blocking streams wait for the fd
+		int timed_out;
+		if (!stream->yielding || stream->nonblocking ||
+		    !is_would_block_error() ||
+		    !stream_drain(stream, -1, &timed_out) ||
+		    !stream_sync_filter(stream)) {
+			return push_error(L, "Failed to flush stream!");
+		}
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int lstream_drain_k(lua_State *L, int status, lua_KContext ctx)
+{
+	(void)status;
+	lua_settop(L, (int)ctx);
+	return lstream_drain(L);
+}
+
+// drain([timeout]) writes the data queued by nonblocking writes, waiting
+// for the stream to become writable, without timeout it waits as long as
+// it takes even on nonblocking streams
+int lstream_drain(lua_State *L)
+{
+	if (!is_writable_stream(L, 1)) {
+		errno = EBADF;
+		return push_error(L, "Not valid writable stream!");
+	}
+	ELI_STREAM *stream = (ELI_STREAM *)lua_touserdata(L, 1);
+	if (stream->closed) {
+		errno = EBADF;
+		return push_error(L, "Stream is not writable (closed)!");
+	}
+	int timeout_ms = lua_isnoneornil(L, 2) ? -1 :
+						 get_timeout_ms(L, stream, 2);
+	begin_yieldable(L, stream);
+	int timed_out;
+	int ok = stream_drain(stream, timeout_ms, &timed_out);
+	stream->may_yield = 0;
+	if (!ok && stream->yield_interest != 0) {
+		return yield_stream(L, stream, lua_gettop(L), lstream_drain_k);
+	}
+	if (timed_out) {
+		lua_pushboolean(L, 0);
+		lua_pushliteral(L, "timeout");
+		return 2;
+	}
+	if (!ok) {
+		return push_error(L, "Failed to drain stream!");
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+int lstream_pending_write_bytes(lua_State *L)
+{
+	if (!is_writable_stream(L, 1)) {
+		errno = EBADF;
+		return push_error(L, "Not valid writable stream!");
+	}
+	ELI_STREAM *stream = (ELI_STREAM *)lua_touserdata(L, 1);
+	size_t pending = stream_buffer_length(&stream->write_buffer);
+	if (stream->filter_source != NULL) {
+		pending += stream_buffer_length(
+			&stream->filter_source->write_buffer);
+	}
+	lua_pushinteger(L, (lua_Integer)pending);
+	return 1;
+}
+
+// set_write_watermark(bytes) limits the data nonblocking writes queue
+int lstream_set_write_watermark(lua_State *L)
+{
+	if (!is_writable_stream(L, 1)) {
+		errno = EBADF;
+		return push_error(L, "Not valid writable stream!");
+	}
+	ELI_STREAM *stream = (ELI_STREAM *)lua_touserdata(L, 1);
+	lua_Integer watermark = luaL_checkinteger(L, 2);
+	luaL_argcheck(L, watermark >= 0, 2, "watermark must be >= 0");
+	stream->write_watermark = (size_t)watermark;
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+int lstream_setvbuf(lua_State *L)
+{
+	static const int modes[] = { ELI_STREAM_BUFFERING_NO,
+				     ELI_STREAM_BUFFERING_FULL,
+				     ELI_STREAM_BUFFERING_LINE };
+	static const char *const mode_names[] = { "no", "full", "line", NULL };
+
+	if (!is_writable_stream(L, 1)) {
+		errno = EBADF;
+		return push_error(L, "Not valid writable stream!");
+	}
+	ELI_STREAM *stream = (ELI_STREAM *)lua_touserdata(L, 1);
+	if (stream->closed) {
+		errno = EBADF;
+		return push_error(L, "Stream is not writable (closed)!");
+	}
+	int mode = luaL_checkoption(L, 2, NULL, mode_names);
+	lua_Integer size = luaL_optinteger(L, 3, LUAL_BUFFERSIZE);
+	if (size <= 0) {
+		return luaL_argerror(L, 3, "buffer size must be > 0");
+	}
+	if (!stream_set_write_buffering(stream, modes[mode], (size_t)size)) {
+		return push_error(L, "Failed to flush stream!");
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+int lstream_seek(lua_State *L)
+{
+	static const int whences[] = { SEEK_SET, SEEK_CUR, SEEK_END };
+	static const char *const whence_names[] = { "set", "cur", "end",
+						    NULL };
+
+	if (!is_stream(L, 1)) {
+		errno = EBADF;
+		return push_error(L, "Not valid ELI_STREAM!");
+	}
+	ELI_STREAM *stream = (ELI_STREAM *)lua_touserdata(L, 1);
+	if (stream->closed) {
+		errno = EBADF;
+		return push_error(L, "Stream is closed!");
 	}
-	if (lua_rawequal(L, -2, -4)) {
-		res = ELI_STREAM_W_KIND;
+	if (stream->filter != NULL) {
+		errno = ESPIPE;
+		return push_error(L, "Compression streams are not seekable!");
 	}
-	if (lua_rawequal(L, -1, -4)) {
-		res = ELI_STREAM_RW_KIND;
+	int whence = whences[luaL_checkoption(L, 2, "cur", whence_names)];
+	lua_Integer offset = luaL_optinteger(L, 3, 0);
+	long long position = stream_seek(stream, whence, offset);
+	if (position == -1) {
+		return push_error(L, "Failed to seek!");
 	}
-
-	lua_pop(L, lua_gettop(L) - top);
-	return res;
+	lua_pushinteger(L, (lua_Integer)position);
+	return 1;
 }
 
-static int is_stream(lua_State *L, int idx)
+int lstream_read_at(lua_State *L)
 {
-	return get_stream_kind(L, idx) != ELI_STREAM_INVALID_KIND;
+	if (!is_readable_stream(L, 1)) {
+		errno = EBADF;
+		return push_error(L, "Not valid readable stream!");
+	}
+	ELI_STREAM *stream = (ELI_STREAM *)lua_touserdata(L, 1);
+	if (stream->closed) {
+		errno = EBADF;
+		return push_error(L, "Stream is not readable (closed)!");
+	}
+	if (stream->filter != NULL) {
+		errno = ESPIPE;
+		return push_error(L, "Compression streams are not seekable!");
+	}
+	lua_Integer offset = luaL_checkinteger(L, 2);
+	luaL_argcheck(L, offset >= 0, 2, "offset must be >= 0");
+	lua_Integer length = luaL_checkinteger(L, 3);
+	luaL_argcheck(L, length >= 0, 3, "length must be >= 0");
+	return stream_read_at(L, stream, offset, (size_t)length);
 }
 
-static int is_readable_stream(lua_State *L, int idx)
+int lstream_write_at(lua_State *L)
 {
-	ELI_STREAM_KIND kind = get_stream_kind(L, idx);
-	return kind == ELI_STREAM_R_KIND || kind == ELI_STREAM_RW_KIND;
+	if (!is_writable_stream(L, 1)) {
+		errno = EBADF;
+		return push_error(L, "Not valid writable stream!");
+	}
+	ELI_STREAM *stream = (ELI_STREAM *)lua_touserdata(L, 1);
+	if (stream->closed) {
+		errno = EBADF;
+		return push_error(L, "Stream is not writable (closed)!");
+	}
+	if (stream->filter != NULL) {
+		errno = ESPIPE;
+		return push_error(L, "Compression streams are not seekable!");
+	}
+	lua_Integer offset = luaL_checkinteger(L, 2);
+	luaL_argcheck(L, offset >= 0, 2, "offset must be >= 0");
+	size_t size;
+	const char *data = luaL_checklstring(L, 3, &size);
+	return stream_write_at(L, stream, offset, data, size);
 }
 
-static int is_writable_stream(lua_State *L, int idx)
+#ifdef ELI_STREAM_ZLIB_SUPPORTED
+static const char *const compression_format_names[] = { "raw", "zlib", "gzip",
+							 "auto", NULL };
+static const ELI_STREAM_ZLIB_FORMAT compression_formats[] = {
+	ELI_STREAM_ZLIB_RAW, ELI_STREAM_ZLIB_ZLIB, ELI_STREAM_ZLIB_GZIP,
+	ELI_STREAM_ZLIB_AUTO
+};
+
+// filter streams share the fd of the source stream at source_idx and keep
+// it alive through their user value, closing a filter leaves the source open
+static int push_filter_stream(lua_State *L, int source_idx, int deflating,
+			      ELI_STREAM_ZLIB_FORMAT format, int level)
 {
-	ELI_STREAM_KIND kind = get_stream_kind(L, idx);
-	return kind == ELI_STREAM_W_KIND || kind == ELI_STREAM_RW_KIND;
+	ELI_STREAM *source = (ELI_STREAM *)lua_touserdata(L, source_idx);
+	ELI_STREAM *stream = eli_new_stream(L);
+	stream->fd = source->fd;
+	stream->not_disposable = 1;
+	stream->nonblocking = source->nonblocking;
+	stream->filter_source = source;
+	lua_pushvalue(L, source_idx);
+	lua_setiuservalue(L, -2, 1);
+	luaL_getmetatable(L, deflating ? ELI_STREAM_W_METATABLE :
+					 ELI_STREAM_R_METATABLE);
+	lua_setmetatable(L, -2);
+	stream->filter = stream_filter_new(deflating, format, level);
+	if (stream->filter == NULL) {
+		stream->closed = 1;
+		errno = ENOMEM;
+		return push_error(L, "Failed to initialize compression!");
+	}
+	return 1;
 }
+#else
+static int push_compression_unavailable(lua_State *L)
+{
+	errno = ENOTSUP;
+	return push_error(L, "Compression is not available (built without zlib)!");
+}
+#endif
 
-int lstream_read(lua_State *L)
+// inflate_reader(stream, [format]) decompresses what is read from stream
+int lstream_inflate_reader(lua_State *L)
 {
 	if (!is_readable_stream(L, 1)) {
 		errno = EBADF;
 		return push_error(L, "Not valid readable stream!");
 	}
-	int stream_index = 1;
-	ELI_STREAM *stream = (ELI_STREAM *)lua_touserdata(L, stream_index);
+	ELI_STREAM *stream = (ELI_STREAM *)lua_touserdata(L, 1);
 	if (stream->closed) {
 		errno = EBADF;
 		return push_error(L, "Stream is not readable (closed)!");
 	}
-
-	double timeout = (double)luaL_optnumber(L, 3, -1);
-	if (timeout < -1) {
-		return luaL_argerror(L, 3, "timeout must be >= 0 or nil");
-	}
-
-	double divider = get_ms_divider_from_state(L, 4, 1.0);
-	double timeout_ms = timeout / divider;
-	if (timeout == -1) {
-		timeout_ms = stream->nonblocking ? 0 : -1;
-	}
-
-	switch (lua_type(L, 2)) {
-	case LUA_TNUMBER: {
-		size_t l = (size_t)luaL_checkinteger(L, 2);
-		return stream_read_bytes(L, stream_index, l,
-					 timeout < 0 ? -1 : timeout_ms);
-	}
-	case LUA_TSTRING: {
-		return stream_read(L, stream_index, luaL_checkstring(L, 2),
-				   timeout_ms);
-	}
-	default:
-		return luaL_argerror(L, 2, "number or string expected");
-	}
+#ifdef ELI_STREAM_ZLIB_SUPPORTED
+	ELI_STREAM_ZLIB_FORMAT format = compression_formats[luaL_checkoption(
+		L, 2, "auto", compression_format_names)];
+	return push_filter_stream(L, 1, 0, format, 0);
+#else
+	return push_compression_unavailable(L);
+#endif
 }
 
-int lstream_write(lua_State *L)
+// deflate_writer(stream, [level], [format]) compresses what is written to
+// stream, the compressed stream is finished when the writer is closed
+int lstream_deflate_writer(lua_State *L)
 {
 	if (!is_writable_stream(L, 1)) {
 		errno = EBADF;
@@ -104,9 +989,32 @@ int lstream_write(lua_State *L)
 		errno = EBADF;
 		return push_error(L, "Stream is not writable (closed)!");
 	}
-	size_t size;
-	const char *data = luaL_checklstring(L, 2, &size);
-	return stream_write(L, stream, data, size);
+#ifdef ELI_STREAM_ZLIB_SUPPORTED
+	lua_Integer level = luaL_optinteger(L, 2, Z_DEFAULT_COMPRESSION);
+	luaL_argcheck(L, level >= -1 && level <= 9, 2,
+		      "level must be between -1 and 9");
+	int format = luaL_checkoption(L, 3, "gzip", compression_format_names);
+	luaL_argcheck(L, compression_formats[format] != ELI_STREAM_ZLIB_AUTO,
+		      3, "format has to be explicit for compression");
+	return push_filter_stream(L, 1, 1, compression_formats[format],
+				  (int)level);
+#else
+	return push_compression_unavailable(L);
+#endif
+}
+
+int lstream_gzip_reader(lua_State *L)
+{
+	lua_settop(L, 1);
+	lua_pushliteral(L, "gzip");
+	return lstream_inflate_reader(L);
+}
+
+int lstream_gzip_writer(lua_State *L)
+{
+	lua_settop(L, 2);
+	lua_pushliteral(L, "gzip");
+	return lstream_deflate_writer(L);
 }
 
 int lstream_close(lua_State *L)
@@ -136,6 +1044,85 @@ int lstream_set_nonblocking(lua_State *L)
 	return 1;
 }
 
+int lstream_set_yielding(lua_State *L)
+{
+	if (!is_stream(L, 1)) {
+		errno = EBADF;
+		return push_error(L, "Not valid ELI_STREAM!");
+	}
+	ELI_STREAM *stream = (ELI_STREAM *)lua_touserdata(L, 1);
+#ifdef _WIN32
+	return push_error(L, "Yielding streams are not supported on Windows!");
+#else
+	int yielding = lua_isboolean(L, 2) ? lua_toboolean(L, 2) : 1;
+	if (!stream_set_yielding(stream, yielding)) {
+		return push_error(L, "Failed to set nonblocking mode!");
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+#endif
+}
+
+#define LSTREAM_DEFAULT_READAHEAD_DEPTH (8 * 1024 * 1024)
+
+// readahead depth from a set_readahead/open_fstream argument, true or nil
+// take the default and false turns readahead off
+// reads the depth at idx, errors name argument arg (the options table when
+// the depth comes from one)
+static lua_Integer get_readahead_depth(lua_State *L, int idx, int arg)
+{
+	if (lua_isnoneornil(L, idx) ||
+	    (lua_isboolean(L, idx) && lua_toboolean(L, idx))) {
+		return LSTREAM_DEFAULT_READAHEAD_DEPTH;
+	}
+	if (lua_isboolean(L, idx)) {
+		return 0;
+	}
+	int is_integer;
+	lua_Integer depth = lua_tointegerx(L, idx, &is_integer);
+	luaL_argcheck(L, is_integer, arg, "depth must be an integer");
+	luaL_argcheck(L, depth >= 0, arg, "depth must be >= 0");
+	return depth;
+}
+
+// set_readahead([depth]) prefetches up to depth bytes of a regular file in
+// a background thread so reads do not wait for the disk
+int lstream_set_readahead(lua_State *L)
+{
+	if (!is_readable_stream(L, 1)) {
+		errno = EBADF;
+		return push_error(L, "Not valid readable stream!");
+	}
+	ELI_STREAM *stream = (ELI_STREAM *)lua_touserdata(L, 1);
+	if (stream->closed) {
+		errno = EBADF;
+		return push_error(L, "Stream is not readable (closed)!");
+	}
+#ifdef _WIN32
+	errno = ENOTSUP;
+	return push_error(L, "Readahead is not supported on Windows!");
+#else
+	lua_Integer depth = get_readahead_depth(L, 2, 2);
+	if (!stream_set_readahead(stream, (size_t)depth)) {
+		return push_error(
+			L, "Failed to set readahead (regular files only)!");
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+#endif
+}
+
+int lstream_is_yielding(lua_State *L)
+{
+	if (!is_stream(L, 1)) {
+		errno = EBADF;
+		return push_error(L, "Not valid ELI_STREAM!");
+	}
+	ELI_STREAM *stream = (ELI_STREAM *)lua_touserdata(L, 1);
+	lua_pushboolean(L, stream->yielding);
+	return 1;
+}
+
 int lstream_is_nonblocking(lua_State *L)
 {
 	if (!is_stream(L, 1)) {
@@ -147,6 +1134,127 @@ int lstream_is_nonblocking(lua_State *L)
 	return 1;
 }
 
+static void push_stats(lua_State *L, const ELI_STREAM_STATS *stats)
+{
+	lua_createtable(L, 0, 11);
+	lua_pushinteger(L, (lua_Integer)stats->bytes_read);
+	lua_setfield(L, -2, "bytes_read");
+	lua_pushinteger(L, (lua_Integer)stats->bytes_written);
+	lua_setfield(L, -2, "bytes_written");
+	lua_pushinteger(L, (lua_Integer)stats->read_syscalls);
+	lua_setfield(L, -2, "read_syscalls");
+	lua_pushinteger(L, (lua_Integer)stats->write_syscalls);
+	lua_setfield(L, -2, "write_syscalls");
+	lua_pushinteger(L, (lua_Integer)stats->would_block);
+	lua_setfield(L, -2, "would_block");
+	lua_pushinteger(L, (lua_Integer)stats->wait_us);
+	lua_setfield(L, -2, "wait_us");
+	lua_pushinteger(L, (lua_Integer)stats->timeouts);
+	lua_setfield(L, -2, "timeouts");
+	lua_pushinteger(L, (lua_Integer)stats->pending_peak);
+	lua_setfield(L, -2, "pending_peak");
+	lua_pushinteger(L, (lua_Integer)stats->bytes_dropped);
+	lua_setfield(L, -2, "bytes_dropped");
+}
+
+int lstream_stats(lua_State *L)
+{
+	if (!is_stream(L, 1)) {
+		errno = EBADF;
+		return push_error(L, "Not valid ELI_STREAM!");
+	}
+	ELI_STREAM *stream = (ELI_STREAM *)lua_touserdata(L, 1);
+	push_stats(L, &stream->stats);
+	lua_pushinteger(L, (lua_Integer)stream_buffer_length(&stream->pending));
+	lua_setfield(L, -2, "pending");
+	return 1;
+}
+
+int lstream_reset_stats(lua_State *L)
+{
+	if (!is_stream(L, 1)) {
+		errno = EBADF;
+		return push_error(L, "Not valid ELI_STREAM!");
+	}
+	ELI_STREAM *stream = (ELI_STREAM *)lua_touserdata(L, 1);
+	memset(&stream->stats, 0, sizeof(stream->stats));
+	stream->stats.pending_peak = stream_buffer_length(&stream->pending);
+	return 0;
+}
+
+// the module wide aggregate is off by default, enabling it costs one more
+// add per counter update
+int lstream_enable_global_stats(lua_State *L)
+{
+	stream_global_stats_enabled =
+		lua_isnoneornil(L, 1) ? 1 : lua_toboolean(L, 1);
+	return 0;
+}
+
+int lstream_global_stats(lua_State *L)
+{
+	push_stats(L, &stream_global_stats);
+	lua_pushboolean(L, stream_global_stats_enabled);
+	lua_setfield(L, -2, "enabled");
+	return 1;
+}
+
+int lstream_reset_global_stats(lua_State *L)
+{
+	(void)L;
+	memset(&stream_global_stats, 0, sizeof(stream_global_stats));
+	return 0;
+}
+
+// enable_digest([algo]) starts a running digest over the data read from and
+// written to the stream, crc32c by default or for true, enable_digest(false)
+// stops it
+int lstream_enable_digest(lua_State *L)
+{
+	static const ELI_STREAM_DIGEST_ALGO algos[] = {
+		ELI_STREAM_DIGEST_CRC32C, ELI_STREAM_DIGEST_XXH64,
+		ELI_STREAM_DIGEST_SHA256
+	};
+	static const char *const algo_names[] = { "crc32c", "xxh64", "sha256",
+						  NULL };
+
+	if (!is_stream(L, 1)) {
+		errno = EBADF;
+		return push_error(L, "Not valid ELI_STREAM!");
+	}
+	ELI_STREAM *stream = (ELI_STREAM *)lua_touserdata(L, 1);
+	ELI_STREAM_DIGEST_ALGO algo = ELI_STREAM_DIGEST_NONE;
+	if (lua_isboolean(L, 2)) {
+		// true picks the default algorithm
+		if (lua_toboolean(L, 2)) {
+			algo = algos[0];
+		}
+	} else {
+		algo = algos[luaL_checkoption(L, 2, "crc32c", algo_names)];
+	}
+	stream_digest_init(&stream->digest, algo);
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+// returns the digest of the data so far as hex string, nil if not enabled
+int lstream_digest(lua_State *L)
+{
+	if (!is_stream(L, 1)) {
+		errno = EBADF;
+		return push_error(L, "Not valid ELI_STREAM!");
+	}
+	ELI_STREAM *stream = (ELI_STREAM *)lua_touserdata(L, 1);
+	if (stream->digest.algo == ELI_STREAM_DIGEST_NONE) {
+		lua_pushnil(L);
+		return 1;
+	}
+	char hex[ELI_STREAM_DIGEST_MAX_HEX_SIZE];
+	stream_digest_hex(&stream->digest, hex);
+	lua_pushstring(L, hex);
+	return 1;
+}
+
 static void clone_stream(lua_State *L, ELI_STREAM *stream)
 {
 	ELI_STREAM *res = eli_new_stream(L);
@@ -155,14 +1263,35 @@ static void clone_stream(lua_State *L, ELI_STREAM *stream)
 	DuplicateHandle(GetCurrentProcess(), stream->fd, GetCurrentProcess(),
 			&res->fd, 0, FALSE, DUPLICATE_SAME_ACCESS);
 #else
+	// the clone inspects its fd afresh, the flags are shared with the
+	// original, so both read them again instead of trusting their cache
 	res->fd = dup(stream->fd);
+	res->shared_fd = 1;
+	stream->shared_fd = 1;
 #endif
 	res->nonblocking = stream->nonblocking;
 }
 
+static int get_boolean_option(lua_State *L, int idx, const char *name)
+{
+	lua_getfield(L, idx, name);
+	int res = lua_toboolean(L, -1);
+	lua_pop(L, 1);
+	return res;
+}
+
+// options (all off by default):
+//   mmap, readahead - see stream_enable_map and set_readahead, a mapped
+//     file may grow while it is read but must not be truncated
+//   direct - uncached I/O (O_DIRECT), not for appending streams
+//   sequential, random, noreuse - access pattern hints (posix_fadvise)
+//   cloexec - the fd is not inherited by executed programs
+//   preallocate - disk space reserved for the file in bytes
+//   drop_cache_after - read data is dropped from the page cache
+//   permissions - of a created file, 0644 by default
+// windows honors sequential, random and preallocate only
 int lopen_fstream(lua_State *L)
 {
-	ELI_STREAM *stream = eli_new_stream(L);
 	const char *path = luaL_checkstring(L, 1);
 	size_t mode_length;
 	const char *mode = luaL_optlstring(L, 2, "r", &mode_length);
@@ -178,9 +1307,69 @@ int lopen_fstream(lua_State *L)
 		return push_error(L, "Invalid mode!");
 	}
 
+	int use_mmap = 0;
+	lua_Integer readahead = 0;
+	int direct = 0;
+	int sequential = 0;
+	int random = 0;
+	int noreuse = 0;
+	int cloexec = 0;
+	int drop_cache_after = 0;
+	lua_Integer preallocate = 0;
+	lua_Integer permissions = 0644;
+	if (!lua_isnoneornil(L, 3)) {
+		luaL_checktype(L, 3, LUA_TTABLE);
+		use_mmap = get_boolean_option(L, 3, "mmap");
+		if (lua_getfield(L, 3, "readahead") != LUA_TNIL) {
+			readahead = get_readahead_depth(L, -1, 3);
+		}
+		lua_pop(L, 1);
+		direct = get_boolean_option(L, 3, "direct");
+		sequential = get_boolean_option(L, 3, "sequential");
+		random = get_boolean_option(L, 3, "random");
+		noreuse = get_boolean_option(L, 3, "noreuse");
+		cloexec = get_boolean_option(L, 3, "cloexec");
+		drop_cache_after = get_boolean_option(L, 3, "drop_cache_after");
+		if (lua_getfield(L, 3, "preallocate") != LUA_TNIL) {
+			int is_integer;
+			preallocate = lua_tointegerx(L, -1, &is_integer);
+			luaL_argcheck(L, is_integer, 3,
+				      "preallocate must be an integer");
+			luaL_argcheck(L, preallocate >= 0, 3,
+				      "preallocate must be >= 0");
+		}
+		lua_pop(L, 1);
+		if (lua_getfield(L, 3, "permissions") != LUA_TNIL) {
+			int is_integer;
+			permissions = lua_tointegerx(L, -1, &is_integer);
+			luaL_argcheck(L, is_integer, 3,
+				      "permissions must be an integer");
+			luaL_argcheck(L, permissions >= 0 && permissions <= 07777,
+				      3, "invalid permissions");
+		}
+		lua_pop(L, 1);
+	}
+	int readable = mode_normalized[0] == 'r' || mode_normalized[1] == '+';
+	int writable = mode_normalized[0] != 'r' || mode_normalized[1] == '+';
+	if (use_mmap && writable) {
+		return push_error(L, "mmap is supported only in read mode!");
+	}
+	if (sequential && random) {
+		return push_error(L, "sequential and random are exclusive!");
+	}
+	if (preallocate > 0 && !writable) {
+		return push_error(L, "preallocate requires a writable mode!");
+	}
+	// O_DIRECT appends land at the unaligned end of the file
+	if (direct && (use_mmap || readahead > 0 || mode_normalized[0] == 'a')) {
+		return push_error(L, "direct does not work with mmap, "
+				     "readahead or append mode!");
+	}
+
+	// arguments are parsed above, the stream must not shift their indices
+	ELI_STREAM *stream = eli_new_stream(L);
 	if (mode_normalized[1] == '+') {
-		//luaL_getmetatable(L, ELI_STREAM_RW_METATABLE);
-		return push_error(L, "Not implemented!");
+		luaL_getmetatable(L, ELI_STREAM_RW_METATABLE);
 	} else {
 		switch (mode_normalized[0]) {
 		case 'r':
@@ -213,15 +1402,22 @@ int lopen_fstream(lua_State *L)
 		break;
 	}
 
-	// if (mode_normalized[1] == '+') {
-	// 	desired_access = GENERIC_READ | GENERIC_WRITE;
-	// }
+	if (mode_normalized[1] == '+') {
+		desired_access = GENERIC_READ | GENERIC_WRITE;
+		if (mode_normalized[0] == 'r') {
+			creation_disposition = OPEN_EXISTING;
+		}
+	}
 
+	DWORD flags = FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED;
+	if (sequential) {
+		flags |= FILE_FLAG_SEQUENTIAL_SCAN;
+	} else if (random) {
+		flags |= FILE_FLAG_RANDOM_ACCESS;
+	}
 	HANDLE fd = CreateFile(path, desired_access,
 			       FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
-			       creation_disposition,
-			       FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED,
-			       NULL);
+			       creation_disposition, flags, NULL);
 
 	if (fd == INVALID_HANDLE_VALUE) {
 		return push_error(L, "Failed to open file!");
@@ -244,15 +1440,58 @@ int lopen_fstream(lua_State *L)
 		break;
 	}
 
-	// if (mode_normalized[1] == '+') {
-	// 	oflag |= O_RDWR;
-	// }
-	int fd = open(path, oflag, 0644);
+	// direct writes read back the partial blocks they merge into
+	if (mode_normalized[1] == '+' || direct) {
+		oflag = (oflag & ~O_ACCMODE) | O_RDWR;
+	}
+	if (cloexec) {
+		oflag |= O_CLOEXEC;
+	}
+	int fd = open(path, oflag, (mode_t)permissions);
 	if (fd == -1) {
 		return push_error(L, "Failed to open file!");
 	}
 #endif
 	stream->fd = fd;
+	if (preallocate > 0 && !stream_preallocate(stream, preallocate)) {
+		return push_error(L, "Failed to preallocate file!");
+	}
+#ifndef _WIN32
+	// on windows the mmap option is ignored and the file is read normally
+	if (use_mmap && !stream_enable_map(stream)) {
+		return push_error(L, "Failed to map file!");
+	}
+	// readahead of a mapping or a write only stream is pointless
+	if (readahead > 0 && !use_mmap && readable &&
+	    !stream_set_readahead(stream, (size_t)readahead)) {
+		return push_error(L, "Failed to set readahead!");
+	}
+	if (direct && !stream_enable_direct(stream)) {
+		return push_error(L, "Failed to enable direct I/O!");
+	}
+#ifdef POSIX_FADV_SEQUENTIAL
+	// hints only, failures do not matter
+	if (sequential) {
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	} else if (random) {
+		posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+	}
+	if (noreuse) {
+		posix_fadvise(fd, 0, 0, POSIX_FADV_NOREUSE);
+	}
+#else
+	(void)noreuse;
+#endif
+	stream->drop_cache_after = drop_cache_after && readable;
+#else
+	// handles are not inherited unless asked for, the rest has no
+	// counterpart for overlapped handles
+	(void)readable;
+	(void)cloexec;
+	(void)noreuse;
+	(void)drop_cache_after;
+	(void)permissions;
+#endif
 	return 1;
 }
 
@@ -284,6 +1523,13 @@ int lstream_rw_as_w(lua_State *L)
 	return 1;
 }
 
+// marks metatable on top of the stack as a stream metatable of given kind
+static void set_stream_kind(lua_State *L, ELI_STREAM_KIND kind)
+{
+	lua_pushinteger(L, kind);
+	lua_rawsetp(L, -2, &STREAM_KIND_KEY);
+}
+
 static void push_stream_base_methods(lua_State *L)
 {
 	lua_pushcfunction(L, lstream_close);
@@ -292,16 +1538,51 @@ static void push_stream_base_methods(lua_State *L)
 	lua_setfield(L, -2, "set_nonblocking");
 	lua_pushcfunction(L, lstream_is_nonblocking);
 	lua_setfield(L, -2, "is_nonblocking");
+	lua_pushcfunction(L, lstream_seek);
+	lua_setfield(L, -2, "seek");
+	lua_pushcfunction(L, lstream_set_yielding);
+	lua_setfield(L, -2, "set_yielding");
+	lua_pushcfunction(L, lstream_is_yielding);
+	lua_setfield(L, -2, "is_yielding");
+	lua_pushcfunction(L, lstream_stats);
+	lua_setfield(L, -2, "stats");
+	lua_pushcfunction(L, lstream_reset_stats);
+	lua_setfield(L, -2, "reset_stats");
+	lua_pushcfunction(L, lstream_enable_digest);
+	lua_setfield(L, -2, "enable_digest");
+	lua_pushcfunction(L, lstream_digest);
+	lua_setfield(L, -2, "digest");
 }
 
 int create_stream_r_meta(lua_State *L)
 {
 	luaL_newmetatable(L, ELI_STREAM_R_METATABLE);
+	set_stream_kind(L, ELI_STREAM_R_KIND);
 
 	/* Method table */
 	lua_newtable(L);
 	lua_pushcfunction(L, lstream_read);
 	lua_setfield(L, -2, "read");
+	lua_pushcfunction(L, lstream_copy_to);
+	lua_setfield(L, -2, "copy_to");
+	lua_pushcfunction(L, lstream_tee_to);
+	lua_setfield(L, -2, "tee_to");
+	lua_pushcfunction(L, lstream_lines);
+	lua_setfield(L, -2, "lines");
+	lua_pushcfunction(L, lstream_read_lines);
+	lua_setfield(L, -2, "read_lines");
+	lua_pushcfunction(L, lstream_read_until);
+	lua_setfield(L, -2, "read_until");
+	lua_pushcfunction(L, lstream_read_frame);
+	lua_setfield(L, -2, "read_frame");
+	lua_pushcfunction(L, lstream_read_into);
+	lua_setfield(L, -2, "read_into");
+	lua_pushcfunction(L, lstream_set_readahead);
+	lua_setfield(L, -2, "set_readahead");
+	lua_pushcfunction(L, lstream_read_at);
+	lua_setfield(L, -2, "read_at");
+	lua_pushcfunction(L, lstream_gzip_reader);
+	lua_setfield(L, -2, "gzip_reader");
 	push_stream_base_methods(L);
 
 	lua_pushstring(L, ELI_STREAM_R_METATABLE);
@@ -318,11 +1599,30 @@ int create_stream_r_meta(lua_State *L)
 int create_stream_w_meta(lua_State *L)
 {
 	luaL_newmetatable(L, ELI_STREAM_W_METATABLE);
+	set_stream_kind(L, ELI_STREAM_W_KIND);
 
 	/* Method table */
 	lua_newtable(L);
 	lua_pushcfunction(L, lstream_write);
 	lua_setfield(L, -2, "write");
+	lua_pushcfunction(L, lstream_write_many);
+	lua_setfield(L, -2, "write_many");
+	lua_pushcfunction(L, lstream_write_frame);
+	lua_setfield(L, -2, "write_frame");
+	lua_pushcfunction(L, lstream_write_at);
+	lua_setfield(L, -2, "write_at");
+	lua_pushcfunction(L, lstream_flush);
+	lua_setfield(L, -2, "flush");
+	lua_pushcfunction(L, lstream_drain);
+	lua_setfield(L, -2, "drain");
+	lua_pushcfunction(L, lstream_pending_write_bytes);
+	lua_setfield(L, -2, "pending_write_bytes");
+	lua_pushcfunction(L, lstream_set_write_watermark);
+	lua_setfield(L, -2, "set_write_watermark");
+	lua_pushcfunction(L, lstream_setvbuf);
+	lua_setfield(L, -2, "setvbuf");
+	lua_pushcfunction(L, lstream_gzip_writer);
+	lua_setfield(L, -2, "gzip_writer");
 	push_stream_base_methods(L);
 
 	lua_pushstring(L, ELI_STREAM_W_METATABLE);
@@ -339,13 +1639,52 @@ int create_stream_w_meta(lua_State *L)
 int create_stream_rw_meta(lua_State *L)
 {
 	luaL_newmetatable(L, ELI_STREAM_RW_METATABLE);
+	set_stream_kind(L, ELI_STREAM_RW_KIND);
 
 	/* Method table */
 	lua_newtable(L);
 	lua_pushcfunction(L, lstream_write);
 	lua_setfield(L, -2, "write");
+	lua_pushcfunction(L, lstream_write_many);
+	lua_setfield(L, -2, "write_many");
+	lua_pushcfunction(L, lstream_write_frame);
+	lua_setfield(L, -2, "write_frame");
+	lua_pushcfunction(L, lstream_write_at);
+	lua_setfield(L, -2, "write_at");
+	lua_pushcfunction(L, lstream_flush);
+	lua_setfield(L, -2, "flush");
+	lua_pushcfunction(L, lstream_drain);
+	lua_setfield(L, -2, "drain");
+	lua_pushcfunction(L, lstream_pending_write_bytes);
+	lua_setfield(L, -2, "pending_write_bytes");
+	lua_pushcfunction(L, lstream_set_write_watermark);
+	lua_setfield(L, -2, "set_write_watermark");
+	lua_pushcfunction(L, lstream_setvbuf);
+	lua_setfield(L, -2, "setvbuf");
 	lua_pushcfunction(L, lstream_read);
 	lua_setfield(L, -2, "read");
+	lua_pushcfunction(L, lstream_copy_to);
+	lua_setfield(L, -2, "copy_to");
+	lua_pushcfunction(L, lstream_tee_to);
+	lua_setfield(L, -2, "tee_to");
+	lua_pushcfunction(L, lstream_lines);
+	lua_setfield(L, -2, "lines");
+	lua_pushcfunction(L, lstream_read_lines);
+	lua_setfield(L, -2, "read_lines");
+	lua_pushcfunction(L, lstream_read_until);
+	lua_setfield(L, -2, "read_until");
+	lua_pushcfunction(L, lstream_read_frame);
+	lua_setfield(L, -2, "read_frame");
+	lua_pushcfunction(L, lstream_read_into);
+	lua_setfield(L, -2, "read_into");
+	lua_pushcfunction(L, lstream_set_readahead);
+	lua_setfield(L, -2, "set_readahead");
+	lua_pushcfunction(L, lstream_read_at);
+	lua_setfield(L, -2, "read_at");
+	lua_pushcfunction(L, lstream_gzip_reader);
+	lua_setfield(L, -2, "gzip_reader");
+	lua_pushcfunction(L, lstream_gzip_writer);
+	lua_setfield(L, -2, "gzip_writer");
 	push_stream_base_methods(L);
 
 	lua_pushcfunction(L, lstream_rw_as_r);
@@ -368,8 +1707,116 @@ int create_stream_rw_meta(lua_State *L)
 	return 1;
 }
 
+#ifndef _WIN32
+// collects fds of streams in the table at idx into fds
+// returns number of streams with buffered data which are ready right away
+static int collect_pollfds(lua_State *L, int idx, int count, int readable,
+			   struct pollfd *fds)
+{
+	int ready = 0;
+	for (int i = 0; i < count; i++) {
+		lua_rawgeti(L, idx, i + 1);
+		if (readable ? !is_readable_stream(L, -1) :
+			       !is_writable_stream(L, -1)) {
+			return luaL_argerror(L, idx,
+					     readable ?
+						     "readable streams expected" :
+						     "writable streams expected");
+		}
+		ELI_STREAM *stream = (ELI_STREAM *)lua_touserdata(L, -1);
+		lua_pop(L, 1);
+		// closed streams have fd -1 which poll ignores
+		fds[i].fd = stream->fd;
+		fds[i].events = readable ? POLLIN : POLLOUT;
+		fds[i].revents = 0;
+		if (readable && stream_buffer_length(&stream->pending) > 0) {
+			ready++;
+		}
+	}
+	return ready;
+}
+
+static void push_ready_streams(lua_State *L, int idx, int count, int readable,
+			       struct pollfd *fds)
+{
+	lua_createtable(L, 0, 0);
+	int n = 0;
+	for (int i = 0; i < count; i++) {
+		lua_rawgeti(L, idx, i + 1);
+		ELI_STREAM *stream = (ELI_STREAM *)lua_touserdata(L, -1);
+		int ready = fds[i].revents != 0 ||
+			    (readable &&
+			     stream_buffer_length(&stream->pending) > 0);
+		if (ready) {
+			lua_rawseti(L, -2, ++n);
+		} else {
+			lua_pop(L, 1);
+		}
+	}
+}
+#endif
+
+int lstream_select(lua_State *L)
+{
+#ifdef _WIN32
+	errno = ENOTSUP;
+	return push_error(L, "select is not supported on this platform!");
+#else
+	int read_count = 0;
+	int write_count = 0;
+	if (!lua_isnoneornil(L, 1)) {
+		luaL_checktype(L, 1, LUA_TTABLE);
+		read_count = (int)lua_rawlen(L, 1);
+	}
+	if (!lua_isnoneornil(L, 2)) {
+		luaL_checktype(L, 2, LUA_TTABLE);
+		write_count = (int)lua_rawlen(L, 2);
+	}
+	double timeout = (double)luaL_optnumber(L, 3, -1);
+	if (timeout < -1) {
+		return luaL_argerror(L, 3, "timeout must be >= 0 or nil");
+	}
+	double divider = get_ms_divider_from_state(L, 4, 1.0);
+	long long deadline =
+		stream_get_deadline(timeout < 0 ? -1 : (int)(timeout / divider));
+
+	struct pollfd *fds = (struct pollfd *)lua_newuserdatauv(
+		L, sizeof(struct pollfd) * (read_count + write_count), 0);
+	int buffered = collect_pollfds(L, 1, read_count, 1, fds);
+	collect_pollfds(L, 2, write_count, 0, fds + read_count);
+
+	int res;
+	do {
+		// streams with buffered data are ready, just check the rest
+		int remaining = buffered > 0 ? 0 :
+					       stream_get_remaining_ms(deadline);
+		res = poll(fds, read_count + write_count, remaining);
+	} while (res == -1 && errno == EINTR);
+	if (res == -1) {
+		return push_error(L, "Failed to poll streams!");
+	}
+
+	push_ready_streams(L, 1, read_count, 1, fds);
+	push_ready_streams(L, 2, write_count, 0, fds + read_count);
+	if (res == 0 && buffered == 0) {
+		lua_pushliteral(L, "timeout");
+		return 3;
+	}
+	return 2;
+#endif
+}
+
 static const struct luaL_Reg eli_stream_extra[] = {
 	{ "open_fstream", lopen_fstream },
+	{ "new_buffer", lbyte_buffer_new },
+	{ "select", lstream_select },
+	{ "poll", lstream_select }, // same call under its poll(2) name
+	{ "reactor", lreactor_new },
+	{ "enable_global_stats", lstream_enable_global_stats },
+	{ "global_stats", lstream_global_stats },
+	{ "reset_global_stats", lstream_reset_global_stats },
+	{ "inflate_reader", lstream_inflate_reader },
+	{ "deflate_writer", lstream_deflate_writer },
 	{ NULL, NULL },
 };
 
@@ -378,6 +1825,8 @@ int luaopen_eli_stream_extra(lua_State *L)
 	create_stream_r_meta(L);
 	create_stream_w_meta(L);
 	create_stream_rw_meta(L);
+	create_reactor_meta(L);
+	create_byte_buffer_meta(L);
 
 	lua_newtable(L);
 	luaL_setfuncs(L, eli_stream_extra, 0);
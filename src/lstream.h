@@ -1,6 +1,9 @@
 #ifndef ELI_LSTREAM_EXTRA_H__
 #define ELI_LSTREAM_EXTRA_H__
 
+#include "stream.h"
+
+ELI_STREAM_KIND get_stream_kind(lua_State *L, int idx);
 int luaopen_eli_stream_extra(lua_State *L);
 
 #endif
\ No newline at end of file
@@ -1,5 +1,11 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,6 +13,25 @@
 #include "lsleep.h"
 #include "lerror.h"
 #include "stream.h"
+#include "stream_buffer.h"
+#include "stream_zlib.h"
+#include "stream_readahead.h"
+#include "stream_direct.h"
+
+// varint needs up to 10 bytes for 64 bit sizes
+#define STREAM_FRAME_MAX_HEADER_SIZE 10
+
+// line iteration reads big chunks so many lines are split per syscall
+#define STREAM_LINES_CHUNK_SIZE (64 * 1024)
+
+// read("a") read size keeps doubling up to this
+#define STREAM_READ_ALL_MAX_CHUNK_SIZE (16 * 1024 * 1024)
+
+// compressed data is moved between a filter and its source in these chunks
+#define STREAM_FILTER_CHUNK_SIZE (16 * 1024)
+
+// drop_cache_after streams give the page cache back in steps of this
+#define STREAM_DROP_CACHE_CHUNK_SIZE (8 * 1024 * 1024)
 
 #ifdef _WIN32
 #include <errno.h>
@@ -25,405 +50,2736 @@
 #define WOULD_BLOCK (GetLastError() == ERROR_NO_DATA)
 #define read_stream(stream, buffer, size) stream_win_read(stream, buffer, size)
 #define write_stream(stream, data, size) stream_win_write(stream, data, size)
+#define pread_stream(stream, buffer, size, offset) \
+	stream_win_read_at(stream, buffer, size, offset)
+#define pwrite_stream(stream, data, size, offset) \
+	stream_win_write_at(stream, data, size, offset)
+#define seek_stream(stream, offset, whence) \
+	stream_win_seek(stream, offset, whence)
 #else
+#include <poll.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#endif
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
 #define STREAM_FD_DEFAULT -1
 #define WOULD_BLOCK (errno == EWOULDBLOCK || errno == EAGAIN)
-#define read_stream(stream, buffer, size) read(stream->fd, buffer, size)
+#define read_stream(stream, buffer, size) stream_read_fd(stream, buffer, size)
 #define write_stream(stream, data, size) write(stream->fd, data, size)
+#define pread_stream(stream, buffer, size, offset) \
+	stream_pread_fd(stream, buffer, size, offset)
+#define pwrite_stream(stream, data, size, offset) \
+	stream_pwrite_fd(stream, data, size, offset)
+#define seek_stream(stream, offset, whence) \
+	stream_seek_fd(stream, offset, whence)
+#endif
+
+#ifdef _WIN32
+#define set_stream_error(posix_error, win_error) SetLastError(win_error)
+#else
+#define set_stream_error(posix_error, win_error) (errno = (posix_error))
+#endif
+
+ELI_STREAM_STATS stream_global_stats;
+int stream_global_stats_enabled;
+
+#ifdef ELI_STREAM_ZLIB_SUPPORTED
+static int read_filtered(ELI_STREAM *stream, char *buffer, size_t size);
+static int write_filtered(ELI_STREAM *stream, ELI_STREAM_IOVEC *iov,
+			  int iovcnt, size_t *written);
+#endif
+
+static void link_ready(ELI_STREAM *stream)
+{
+	ELI_STREAM_READY_LIST *list = stream->ready_list;
+	stream->ready_prev = NULL;
+	stream->ready_next = list->head;
+	if (list->head != NULL) {
+		list->head->ready_prev = stream;
+	}
+	list->head = stream;
+	list->count++;
+}
+
+static void unlink_ready(ELI_STREAM *stream)
+{
+	ELI_STREAM_READY_LIST *list = stream->ready_list;
+	if (stream->ready_prev != NULL) {
+		stream->ready_prev->ready_next = stream->ready_next;
+	} else {
+		list->head = stream->ready_next;
+	}
+	if (stream->ready_next != NULL) {
+		stream->ready_next->ready_prev = stream->ready_prev;
+	}
+	stream->ready_prev = NULL;
+	stream->ready_next = NULL;
+	list->count--;
+}
+
+static int is_ready_linked(ELI_STREAM *stream)
+{
+	return stream->ready_list != NULL &&
+	       (stream->ready_prev != NULL || stream->ready_list->head == stream);
+}
+
+// called whenever the pending data of the stream grows or shrinks
+void stream_note_pending(ELI_STREAM *stream)
+{
+	size_t pending = stream_buffer_length(&stream->pending);
+	if (pending > stream->stats.pending_peak) {
+		stream->stats.pending_peak = pending;
+	}
+	if (stream_global_stats_enabled &&
+	    pending > stream_global_stats.pending_peak) {
+		stream_global_stats.pending_peak = pending;
+	}
+	if (stream->ready_list == NULL) {
+		return;
+	}
+	int ready = pending > 0 && !stream->closed;
+	if (ready != is_ready_linked(stream)) {
+		if (ready) {
+			link_ready(stream);
+		} else {
+			unlink_ready(stream);
+		}
+	}
+}
+
+// a stream is tracked by one list at a time, NULL stops the tracking
+void stream_set_ready_list(ELI_STREAM *stream, ELI_STREAM_READY_LIST *list)
+{
+	if (is_ready_linked(stream)) {
+		unlink_ready(stream);
+	}
+	stream->ready_list = list;
+	stream_note_pending(stream);
+}
+
+static void count_write(ELI_STREAM *stream, long long res)
+{
+	STREAM_STATS_ADD(stream, write_syscalls, 1);
+	if (res > 0) {
+		STREAM_STATS_ADD(stream, bytes_written, res);
+	} else if (res == -1 && WOULD_BLOCK) {
+		STREAM_STATS_ADD(stream, would_block, 1);
+	}
+}
+
+static void count_timeout(ELI_STREAM *stream, int timed_out)
+{
+	if (timed_out) {
+		STREAM_STATS_ADD(stream, timeouts, 1);
+	}
+}
+
+#ifndef _WIN32
+// direct streams track their position themselves instead of moving the
+// fd offset around each positional transfer
+static ssize_t read_direct(ELI_STREAM *stream, char *buffer, size_t size)
+{
+	ELI_STREAM_DIRECT *direct = stream->direct;
+	ssize_t res =
+		stream_direct_pread(direct, buffer, size, direct->position);
+	if (res > 0) {
+		direct->position += res;
+	}
+	return res;
+}
+
+static ssize_t write_direct(ELI_STREAM *stream, const char *data, size_t size)
+{
+	ELI_STREAM_DIRECT *direct = stream->direct;
+	ssize_t res =
+		stream_direct_pwrite(direct, data, size, direct->position);
+	if (res > 0) {
+		direct->position += res;
+	}
+	return res;
+}
+
+static off_t stream_seek_fd(ELI_STREAM *stream, off_t offset, int whence)
+{
+	if (stream->direct != NULL) {
+		return stream_direct_seek(stream->direct, offset, whence);
+	}
+	return lseek(stream->fd, offset, whence);
+}
+
+static ssize_t stream_pread_fd(ELI_STREAM *stream, char *buffer, size_t size,
+			       off_t offset)
+{
+	if (stream->direct != NULL) {
+		return stream_direct_pread(stream->direct, buffer, size,
+					   offset);
+	}
+	return pread(stream->fd, buffer, size, offset);
+}
+
+static ssize_t stream_pwrite_fd(ELI_STREAM *stream, const char *data,
+				size_t size, off_t offset)
+{
+	if (stream->direct != NULL) {
+		return stream_direct_pwrite(stream->direct, data, size,
+					    offset);
+	}
+	return pwrite(stream->fd, data, size, offset);
+}
+#endif
+
+// writes all vectors, resuming after short writes, iov is modified
+// returns 1 on success, 0 on failure with *written set to bytes written
+static int write_all(ELI_STREAM *stream, ELI_STREAM_IOVEC *iov, int iovcnt,
+		     size_t *written)
+{
+#ifdef ELI_STREAM_ZLIB_SUPPORTED
+	if (stream->filter != NULL) {
+		return write_filtered(stream, iov, iovcnt, written);
+	}
+#endif
+	size_t total_written = 0;
+#ifdef _WIN32
+	for (int i = 0; i < iovcnt; i++) {
+		size_t offset = 0;
+		while (offset < iov[i].iov_len) {
+			int res = write_stream(
+				stream, (const char *)iov[i].iov_base + offset,
+				iov[i].iov_len - offset);
+			count_write(stream, res);
+			if (res == -1) {
+				*written = total_written;
+				return 0;
+			}
+			offset += res;
+			total_written += res;
+		}
+	}
+#else
+	if (stream->direct != NULL) {
+		for (int i = 0; i < iovcnt; i++) {
+			size_t offset = 0;
+			while (offset < iov[i].iov_len) {
+				ssize_t res = write_direct(
+					stream,
+					(const char *)iov[i].iov_base + offset,
+					iov[i].iov_len - offset);
+				count_write(stream, res);
+				if (res == -1) {
+					*written = total_written;
+					return 0;
+				}
+				offset += res;
+				total_written += res;
+			}
+		}
+		*written = total_written;
+		return 1;
+	}
+	while (iovcnt > 0) {
+		ssize_t res = writev(stream->fd, iov,
+				     iovcnt > IOV_MAX ? IOV_MAX : iovcnt);
+		count_write(stream, res);
+		if (res == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			*written = total_written;
+			return 0;
+		}
+		total_written += res;
+		// skip fully written vectors and resume within the partial one
+		while (iovcnt > 0 && (size_t)res >= iov->iov_len) {
+			res -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + res;
+			iov->iov_len -= res;
+		}
+	}
+#endif
+	*written = total_written;
+	return 1;
+}
+
+int stream_flush(ELI_STREAM *stream)
+{
+	size_t length = stream_buffer_length(&stream->write_buffer);
+	if (length == 0) {
+		return 1;
+	}
+	ELI_STREAM_IOVEC iov = { stream_buffer_data(&stream->write_buffer),
+				 length };
+	size_t written;
+	int ok = write_all(stream, &iov, 1, &written);
+	// keep whatever was not written for the next flush
+	stream_buffer_consume(&stream->write_buffer, written);
+	return ok;
+}
+
+// a full buffer of a direct stream keeps the unaligned tail for the next
+// write, so the device gets whole blocks
+static int flush_full_buffer(ELI_STREAM *stream)
+{
+#ifndef _WIN32
+	if (stream->direct != NULL) {
+		size_t length = stream_buffer_length(&stream->write_buffer);
+		size_t head = (size_t)(stream->direct->position %
+				       ELI_STREAM_DIRECT_ALIGNMENT);
+		head = head == 0 ? 0 : ELI_STREAM_DIRECT_ALIGNMENT - head;
+		if (length >= head + ELI_STREAM_DIRECT_ALIGNMENT) {
+			length -= (length - head) % ELI_STREAM_DIRECT_ALIGNMENT;
+			ELI_STREAM_IOVEC iov = {
+				stream_buffer_data(&stream->write_buffer), length
+			};
+			size_t written;
+			int ok = write_all(stream, &iov, 1, &written);
+			stream_buffer_consume(&stream->write_buffer, written);
+			return ok;
+		}
+	}
+#endif
+	return stream_flush(stream);
+}
+
+// direct streams are always fully buffered in whole blocks
+int stream_set_write_buffering(ELI_STREAM *stream,
+			       ELI_STREAM_BUFFERING buffering, size_t size)
+{
+	if (!stream_flush(stream)) {
+		return 0;
+	}
+#ifndef _WIN32
+	if (stream->direct != NULL) {
+		buffering = ELI_STREAM_BUFFERING_FULL;
+		size = size < ELI_STREAM_DIRECT_ALIGNMENT ?
+			       ELI_STREAM_DIRECT_ALIGNMENT :
+			       size - size % ELI_STREAM_DIRECT_ALIGNMENT;
+	}
+#endif
+	stream->write_buffering = buffering;
+	stream->write_buffer_size = size;
+	if (buffering == ELI_STREAM_BUFFERING_NO) {
+		stream_buffer_free(&stream->write_buffer);
+	}
+	return 1;
+}
+
+// returns 0 if out of memory, *has_new_line tells line buffering to flush
+static int append_to_write_buffer(ELI_STREAM *stream, ELI_STREAM_IOVEC *iov,
+				  int iovcnt, int *has_new_line)
+{
+	*has_new_line = 0;
+	for (int i = 0; i < iovcnt; i++) {
+		if (!stream_buffer_append(&stream->write_buffer,
+					  iov[i].iov_base, iov[i].iov_len)) {
+			return 0;
+		}
+		if (stream->write_buffering == ELI_STREAM_BUFFERING_LINE &&
+		    !*has_new_line) {
+			*has_new_line = memchr(iov[i].iov_base, '\n',
+					       iov[i].iov_len) != NULL;
+		}
+	}
+	return 1;
+}
+
+// yielding writes queue the data and try to flush it, the coroutine then
+// waits for the rest to drain
+static int write_through_buffer(ELI_STREAM *stream, ELI_STREAM_IOVEC *iov,
+				int iovcnt, size_t size, size_t *written)
+{
+	for (int i = 0; i < iovcnt; i++) {
+		if (!stream_buffer_append(&stream->write_buffer,
+					  iov[i].iov_base, iov[i].iov_len)) {
+#ifndef _WIN32
+			errno = ENOMEM;
+#endif
+			return 0;
+		}
+	}
+	*written = size;
+	if (stream_flush(stream)) {
+		return 1;
+	}
+	if (!WOULD_BLOCK) {
+		return 0;
+	}
+	stream->yield_interest = 'w';
+	return ELI_STREAM_YIELD;
+}
+
+#ifndef _WIN32
+// the readahead thread moves the fd offset, so it is stopped whenever the
+// offset matters to someone else, the next read starts it again
+static int pause_readahead(ELI_STREAM *stream)
+{
+	if (stream->readahead == NULL) {
+		return 1;
+	}
+	int ok = stream_readahead_stop(stream->readahead);
+	stream->readahead = NULL;
+	return ok;
+}
+#endif
+
+// a write to a file continues where the reader is, not where the fd got
+// by reading ahead, so the read ahead data is given back first
+static int discard_read_ahead(ELI_STREAM *stream)
+{
+	size_t pending = stream_buffer_length(&stream->pending);
+#ifndef _WIN32
+	if (!pause_readahead(stream)) {
+		return 0;
+	}
+	if (pending == 0 || stream->fd_kind != ELI_STREAM_FD_FILE) {
+		return 1;
+	}
+	if (seek_stream(stream, -(off_t)pending, SEEK_CUR) == -1) {
+		return 0;
+	}
+	stream_buffer_consume(&stream->pending, pending);
+	stream_note_pending(stream);
 #endif
+	return 1;
+}
+
+// nonblocking writes queue what the fd does not take right away up to the
+// write watermark, the rest is refused with ELI_STREAM_WOULD_BLOCK
+static int write_queued(ELI_STREAM *stream, ELI_STREAM_IOVEC *iov,
+			int iovcnt, size_t size, size_t *written)
+{
+	*written = 0;
+	// queued data goes first
+	if (!stream_flush(stream) && !WOULD_BLOCK) {
+		return 0;
+	}
+	size_t queued = stream_buffer_length(&stream->write_buffer);
+	size_t accepted = 0;
+	if (queued == 0 && iovcnt == 1) {
+		// the usual single write does not go through the queue
+		ELI_STREAM_IOVEC rest = iov[0];
+		int ok = write_all(stream, &rest, 1, &accepted);
+		if (ok || !WOULD_BLOCK) {
+			*written = accepted;
+			return ok;
+		}
+	}
+	size_t room = stream->write_watermark > queued ?
+			      stream->write_watermark - queued :
+			      0;
+	size_t skip = accepted;
+	for (int i = 0; i < iovcnt && room > 0; i++) {
+		if (skip >= iov[i].iov_len) {
+			skip -= iov[i].iov_len;
+			continue;
+		}
+		size_t part = iov[i].iov_len - skip;
+		if (part > room) {
+			part = room;
+		}
+		if (!stream_buffer_append(&stream->write_buffer,
+					  (const char *)iov[i].iov_base + skip,
+					  part)) {
+			set_stream_error(ENOMEM, ERROR_NOT_ENOUGH_MEMORY);
+			*written = accepted;
+			return 0;
+		}
+		skip = 0;
+		accepted += part;
+		room -= part;
+	}
+	*written = accepted;
+	// vectors were queued without trying the fd first
+	if (queued == 0 && iovcnt > 1 && !stream_flush(stream) && !WOULD_BLOCK) {
+		return 0;
+	}
+	return accepted == size ? 1 : ELI_STREAM_WOULD_BLOCK;
+}
+
+static int drain_until(ELI_STREAM *stream, long long deadline, int *timed_out);
+
+// yielding streams keep their fd nonblocking for the coroutines, a blocking
+// stream written outside of one waits for its queue to drain instead
+static int drain_if_blocking(ELI_STREAM *stream)
+{
+	if (!stream->yielding || stream->nonblocking || !WOULD_BLOCK) {
+		return 0;
+	}
+	int timed_out;
+	return drain_until(stream, -1, &timed_out);
+}
+
+static int write_vectors(ELI_STREAM *stream, ELI_STREAM_IOVEC *iov,
+			 int iovcnt, size_t *written)
+{
+	if (!discard_read_ahead(stream)) {
+		*written = 0;
+		return 0;
+	}
+	size_t size = 0;
+	for (int i = 0; i < iovcnt; i++) {
+		size += iov[i].iov_len;
+	}
+	*written = 0;
+	if (stream->write_buffering != ELI_STREAM_BUFFERING_NO) {
+		if (stream_buffer_length(&stream->write_buffer) + size >
+		    stream->write_buffer_size) {
+			if (!flush_full_buffer(stream)) {
+				if (stream->may_yield && WOULD_BLOCK) {
+					return write_through_buffer(
+						stream, iov, iovcnt, size,
+						written);
+				}
+				if (stream->may_queue && WOULD_BLOCK) {
+					return write_queued(stream, iov, iovcnt,
+							    size, written);
+				}
+				if (!drain_if_blocking(stream)) {
+					return 0;
+				}
+			}
+		}
+		// anything that does not fit into the buffer goes directly
+		if (size < stream->write_buffer_size) {
+			size_t buffered =
+				stream_buffer_length(&stream->write_buffer);
+			int has_new_line;
+			if (append_to_write_buffer(stream, iov, iovcnt,
+						   &has_new_line)) {
+				// the data is accepted, a failed flush keeps it
+				// queued and may already have written a part
+				*written = size;
+				if (!has_new_line || stream_flush(stream)) {
+					return 1;
+				}
+				if (stream->may_yield && WOULD_BLOCK) {
+					stream->yield_interest = 'w';
+					return ELI_STREAM_YIELD;
+				}
+				return (stream->may_queue && WOULD_BLOCK) ||
+				       drain_if_blocking(stream);
+			}
+			// undo the partial append before writing directly
+			stream_buffer_truncate(&stream->write_buffer, buffered);
+		}
+	}
+	if (stream->may_yield) {
+		return write_through_buffer(stream, iov, iovcnt, size, written);
+	}
+	if (stream->may_queue) {
+		return write_queued(stream, iov, iovcnt, size, written);
+	}
+	if (stream->yielding && !stream->nonblocking) {
+		int res = write_through_buffer(stream, iov, iovcnt, size, written);
+		return res == ELI_STREAM_YIELD ? drain_if_blocking(stream) : res;
+	}
+	// data left by a yielding write goes first
+	if (!stream_flush(stream)) {
+		return 0;
+	}
+	return write_all(stream, iov, iovcnt, written);
+}
+
+static void digest_vectors(ELI_STREAM *stream, const ELI_STREAM_IOVEC *iov,
+			   int iovcnt, size_t length)
+{
+	for (int i = 0; i < iovcnt && length > 0; i++) {
+		size_t part = iov[i].iov_len < length ? iov[i].iov_len : length;
+		stream_digest_update(&stream->digest, iov[i].iov_base, part);
+		length -= part;
+	}
+}
+
+int stream_writev(ELI_STREAM *stream, ELI_STREAM_IOVEC *iov, int iovcnt,
+		  size_t *written)
+{
+	if (stream->digest.algo == ELI_STREAM_DIGEST_NONE) {
+		return write_vectors(stream, iov, iovcnt, written);
+	}
+	// writing advances the vectors, the accepted data is hashed from the
+	// untouched originals afterwards
+	ELI_STREAM_IOVEC local[8];
+	ELI_STREAM_IOVEC *copy = local;
+	if (iovcnt > 8) {
+		copy = malloc(sizeof(ELI_STREAM_IOVEC) * iovcnt);
+		if (copy == NULL) {
+			set_stream_error(ENOMEM, ERROR_NOT_ENOUGH_MEMORY);
+			*written = 0;
+			return 0;
+		}
+	}
+	memcpy(copy, iov, sizeof(ELI_STREAM_IOVEC) * iovcnt);
+	int res = write_vectors(stream, copy, iovcnt, written);
+	digest_vectors(stream, iov, iovcnt, *written);
+	if (copy != local) {
+		free(copy);
+	}
+	return res;
+}
+
+int stream_push_write_result(lua_State *L, int status, size_t written)
+{
+	if (status == ELI_STREAM_WOULD_BLOCK) {
+		lua_pushinteger(L, (lua_Integer)written);
+		lua_pushliteral(L, "would block");
+		return 2;
+	}
+	if (status) {
+		lua_pushinteger(L, (lua_Integer)written);
+		return 1;
+	}
+	luaL_fileresult(L, status, NULL);
+	lua_pushinteger(L, (lua_Integer)written);
+	return 4;
+}
 
 int stream_write(lua_State *L, ELI_STREAM *stream, const char *data,
 		 size_t size)
 {
-	size_t status = write_stream(stream, data, size) == size;
-	if (status) {
-		lua_pushboolean(L, status);
+	ELI_STREAM_IOVEC iov = { (void *)data, size };
+	size_t written;
+	int status = stream_writev(stream, &iov, 1, &written);
+	return stream_push_write_result(L, status, written);
+}
+
+static int push_read_result(lua_State *L, int res, int timed_out)
+{
+	if (timed_out) {
+		// data we read so far
+		lua_pushliteral(L, "timeout");
+		return 2;
+	}
+
+	switch (res) {
+	case -1:
+		if (!WOULD_BLOCK) {
+			// we push nil only if it's not WOULD_BLOCK
+			// because if it is WOULD_BLOCK, there may be some data later
+			lua_pushnil(L);
+		}
+		push_error_string(L, NULL);
+		lua_pushinteger(L, errno);
+		return 3;
+	case 0:
+		lua_pushnil(L); // EOF
+	default:
 		return 1;
 	}
-	return luaL_fileresult(L, status, NULL);
-}
-
-static int push_read_result(lua_State *L, int res, int timed_out)
-{
+}
+
+static long long get_monotonic_time_in_ms()
+{
+#ifdef _WIN32
+	return (long long)GetTickCount64();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+// returns absolute deadline on the monotonic clock or -1 if there is none
+long long stream_get_deadline(int timeout_ms)
+{
+	if (timeout_ms < 0) {
+		return -1;
+	}
+	return get_monotonic_time_in_ms() + timeout_ms;
+}
+
+// returns ms left until the deadline, 0 if it passed, -1 if there is none
+int stream_get_remaining_ms(long long deadline)
+{
+	if (deadline == -1) {
+		return -1;
+	}
+	long long remaining = deadline - get_monotonic_time_in_ms();
+	if (remaining <= 0) {
+		return 0;
+	}
+	return remaining > INT_MAX ? INT_MAX : (int)remaining;
+}
+
+static long long get_monotonic_time_in_us()
+{
+#ifdef _WIN32
+	return (long long)GetTickCount64() * 1000;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+static int is_deadline_exceeded(long long deadline)
+{
+	return deadline != -1 && deadline < get_monotonic_time_in_ms();
+}
+
+// waits until the reader is readable and the writer is writable,
+// either of them may be NULL
+// returns 0 if the deadline passed before all of them became ready
+static int poll_streams(ELI_STREAM *reader, ELI_STREAM *writer,
+			long long deadline)
+{
+	int remaining = stream_get_remaining_ms(deadline);
+	if (remaining == 0) {
+		return 0;
+	}
+#ifdef _WIN32
+	// pipes and overlapped files can not be polled, sleep instead
+	int sleep_per_iteration = remaining == -1 ? 100 : remaining / 10;
+	if (sleep_per_iteration <= 0) {
+		sleep_per_iteration = 1; // at least 1 ms
+	}
+	sleep_ms(sleep_per_iteration);
+	return 1;
+#else
+	struct pollfd fds[2];
+	int nfds = 0;
+	if (reader != NULL) {
+		fds[nfds++] = (struct pollfd){ reader->fd, POLLIN, 0 };
+	}
+	if (writer != NULL) {
+		fds[nfds++] = (struct pollfd){ writer->fd, POLLOUT, 0 };
+	}
+	for (;;) {
+		int res = poll(fds, nfds, remaining);
+		if (res == 0) {
+			return 0;
+		}
+		if (res == -1) {
+			// EINTR and friends are handled by the caller retrying
+			return 1;
+		}
+		// keep waiting only for those which are not ready yet
+		int not_ready = 0;
+		for (int i = 0; i < nfds; i++) {
+			if (fds[i].revents != 0) {
+				fds[i].fd = -1;
+			} else if (fds[i].fd >= 0) {
+				not_ready++;
+			}
+		}
+		if (not_ready == 0) {
+			return 1;
+		}
+		remaining = stream_get_remaining_ms(deadline);
+		if (remaining == 0) {
+			return 0;
+		}
+	}
+#endif
+}
+
+static int wait_streams(ELI_STREAM *reader, ELI_STREAM *writer,
+			long long deadline)
+{
+	// yielding operations stop here as if timed out, see ELI_STREAM_YIELD
+	if (reader != NULL && reader->may_yield) {
+		reader->yield_interest = 'r';
+		return 0;
+	}
+	if (writer != NULL && writer->may_yield) {
+		writer->yield_interest = 'w';
+		return 0;
+	}
+	long long start = get_monotonic_time_in_us();
+	int res = poll_streams(reader, writer, deadline);
+	long long waited = get_monotonic_time_in_us() - start;
+	if (reader != NULL) {
+		STREAM_STATS_ADD(reader, wait_us, waited);
+	}
+	if (writer != NULL) {
+		STREAM_STATS_ADD(writer, wait_us, waited);
+	}
+	return res;
+}
+
+// returns 0 if the deadline passed without the stream becoming readable
+static int wait_readable(ELI_STREAM *stream, long long deadline)
+{
+	return wait_streams(stream, NULL, deadline);
+}
+
+static int drain_until(ELI_STREAM *stream, long long deadline, int *timed_out)
+{
+	while (!stream_flush(stream)) {
+#ifndef _WIN32
+		if (errno == EINTR) {
+			continue;
+		}
+#endif
+		if (!WOULD_BLOCK) {
+			return 0;
+		}
+		if (!wait_streams(NULL, stream, deadline)) {
+			*timed_out = 1;
+			return 0;
+		}
+	}
+	// filters queue the compressed data on their source
+	return stream->filter_source == NULL ||
+	       drain_until(stream->filter_source, deadline, timed_out);
+}
+
+// writes the queued data waiting for the fd to become writable
+// returns 0 on failure or with *timed_out set when the time is up
+int stream_drain(ELI_STREAM *stream, int timeout_ms, int *timed_out)
+{
+	*timed_out = 0;
+	int ok = drain_until(stream, stream_get_deadline(timeout_ms),
+			     timed_out);
+	count_timeout(stream, *timed_out);
+	return ok;
+}
+
+#ifndef _WIN32
+// inspects the fd once, later reads rely on the cached kind and flags
+static void detect_fd_kind(ELI_STREAM *stream)
+{
+	int flags = fcntl(stream->fd, F_GETFL, 0);
+	stream->fd_flags = flags < 0 ? 0 : flags;
+	struct stat st;
+	if (fstat(stream->fd, &st) == -1) {
+		stream->fd_kind = ELI_STREAM_FD_OTHER;
+	} else if (S_ISREG(st.st_mode)) {
+		stream->fd_kind = ELI_STREAM_FD_FILE;
+	} else if (S_ISSOCK(st.st_mode)) {
+		stream->fd_kind = ELI_STREAM_FD_SOCKET;
+	} else {
+		stream->fd_kind = ELI_STREAM_FD_OTHER;
+	}
+}
+
+// the flags of a description shared with a clone change behind the
+// stream's back, they are read again before the stream relies on them
+static void refresh_fd_flags(ELI_STREAM *stream)
+{
+	if (stream->fd_kind == ELI_STREAM_FD_UNKNOWN) {
+		detect_fd_kind(stream);
+		return;
+	}
+	if (stream->shared_fd) {
+		int flags = fcntl(stream->fd, F_GETFL, 0);
+		if (flags >= 0) {
+			stream->fd_flags = flags;
+		}
+	}
+}
+
+static ssize_t stream_read_fd(ELI_STREAM *stream, char *buffer, size_t size)
+{
+	if (stream->fd_kind == ELI_STREAM_FD_SOCKET) {
+		return recv(stream->fd, buffer, size, MSG_DONTWAIT);
+	}
+	if (stream->direct != NULL) {
+		return read_direct(stream, buffer, size);
+	}
+	return read(stream->fd, buffer, size);
+}
+
+// the data is copied out of the page cache by the time it is read, so the
+// cache up to the fd offset can go, readahead included
+static void drop_cache_behind(ELI_STREAM *stream, size_t length)
+{
+#ifdef POSIX_FADV_DONTNEED
+	stream->drop_cache_pending += length;
+	if (stream->drop_cache_pending < STREAM_DROP_CACHE_CHUNK_SIZE) {
+		return;
+	}
+	stream->drop_cache_pending = 0;
+	off_t offset = lseek(stream->fd, 0, SEEK_CUR);
+	if (offset > 0) {
+		posix_fadvise(stream->fd, 0, offset, POSIX_FADV_DONTNEED);
+	}
+#else
+	(void)stream;
+	(void)length;
+#endif
+}
+#endif
+
+static int stream_set_nonblocking(ELI_STREAM *stream, int nonblocking)
+{
+#ifndef _WIN32
+	if (stream->fd < 0) {
+		errno = EBADF;
+		return 0;
+	}
+	refresh_fd_flags(stream);
+	// the flags are cached since the detection, only setting them is left
+	int flags = nonblocking ? stream->fd_flags | O_NONBLOCK :
+				  stream->fd_flags & ~O_NONBLOCK;
+	if (flags == stream->fd_flags) {
+		return 1;
+	}
+	if (fcntl(stream->fd, F_SETFL, flags) == -1) {
+		return 0;
+	}
+	stream->fd_flags = flags;
+#endif
+	return 1;
+}
+
+// the fd keeps the mode the stream asks for and is switched only when that
+// changes, reads of a blocking fd which may not wait past the deadline
+// poll it first instead of switching it to nonblocking mode and back
+static void start_reads(ELI_STREAM *stream, long long deadline)
+{
+	// filters share the fd of their source, its mode is what matters
+	if (stream->filter_source != NULL) {
+		start_reads(stream->filter_source, deadline);
+		return;
+	}
+#ifndef _WIN32
+	if (stream->fd < 0) {
+		return;
+	}
+	if (stream->fd_kind == ELI_STREAM_FD_UNKNOWN) {
+		detect_fd_kind(stream);
+	}
+	if (stream->fd_kind != ELI_STREAM_FD_OTHER) {
+		return;
+	}
+	// stream_set_nonblocking refreshes the flags of a shared fd
+	// a failure leaves the reads polling the fd
+	stream_set_nonblocking(stream, stream->nonblocking || stream->yielding);
+	stream->poll_reads = deadline != -1 && !(stream->fd_flags & O_NONBLOCK);
+#endif
+}
+
+static void end_reads(ELI_STREAM *stream)
+{
+	if (stream->filter_source != NULL) {
+		end_reads(stream->filter_source);
+		return;
+	}
+#ifndef _WIN32
+	stream->poll_reads = 0;
+#endif
+}
+
+#ifndef _WIN32
+static int is_readable_now(ELI_STREAM *stream)
+{
+	struct pollfd fds = { stream->fd, POLLIN, 0 };
+	// errors are left to the read to report
+	return poll(&fds, 1, 0) != 0;
+}
+#endif
+
+static int read_counted(ELI_STREAM *stream, char *buffer, size_t size)
+{
+	// a read after buffered writes has to see them
+	if (stream_buffer_length(&stream->write_buffer) > 0 &&
+	    !stream_flush(stream)) {
+		return -1;
+	}
+#ifdef ELI_STREAM_ZLIB_SUPPORTED
+	if (stream->filter != NULL) {
+		int res = read_filtered(stream, buffer, size);
+		if (res > 0) {
+			STREAM_STATS_ADD(stream, bytes_read, res);
+		}
+		return res;
+	}
+#endif
+#ifndef _WIN32
+	if (stream->readahead_depth > 0) {
+		if (stream->readahead == NULL) {
+			stream->readahead = stream_readahead_start(
+				stream->fd, stream->readahead_depth);
+			if (stream->readahead == NULL) {
+				return -1;
+			}
+		}
+		int res = stream_readahead_read(stream->readahead, buffer, size);
+		// the thread is done at EOF, the next read starts a new one to
+		// see data appended meanwhile, as a plain read would
+		if (res == 0 && !pause_readahead(stream)) {
+			return -1;
+		}
+		if (res > 0) {
+			STREAM_STATS_ADD(stream, bytes_read, res);
+			if (stream->drop_cache_after) {
+				drop_cache_behind(stream, res);
+			}
+		}
+		return res;
+	}
+#endif
+#ifndef _WIN32
+	if (stream->poll_reads && !is_readable_now(stream)) {
+		errno = EAGAIN;
+		STREAM_STATS_ADD(stream, would_block, 1);
+		return -1;
+	}
+#endif
+	int res = read_stream(stream, buffer, size);
+	stream_count_read(stream, res);
+	return res;
+}
+
+void stream_count_read(ELI_STREAM *stream, int res)
+{
+	STREAM_STATS_ADD(stream, read_syscalls, 1);
+	if (res > 0) {
+		STREAM_STATS_ADD(stream, bytes_read, res);
+#ifndef _WIN32
+		if (stream->drop_cache_after) {
+			drop_cache_behind(stream, res);
+		}
+#endif
+	} else if (res == -1 && WOULD_BLOCK) {
+		STREAM_STATS_ADD(stream, would_block, 1);
+	}
+}
+
+// filters, readahead and direct I/O read through their own layers and
+// buffered writes have to be flushed first, see read_counted
+int stream_reads_fd_directly(ELI_STREAM *stream)
+{
+	if (stream->closed || stream->filter != NULL ||
+	    stream_buffer_length(&stream->write_buffer) > 0) {
+		return 0;
+	}
+#ifndef _WIN32
+	if (stream->use_mmap || stream->readahead_depth > 0 ||
+	    stream->direct != NULL) {
+		return 0;
+	}
+#endif
+	return 1;
+}
+
+// reserves disk space for size bytes of the file without changing its
+// size, filesystems that cannot do it just do not get the hint
+int stream_preallocate(ELI_STREAM *stream, long long size)
+{
+#ifdef _WIN32
+	LARGE_INTEGER current;
+	if (!GetFileSizeEx(stream->fd, &current)) {
+		return 0;
+	}
+	// a smaller allocation than the file size would truncate it
+	if (size <= current.QuadPart) {
+		return 1;
+	}
+	FILE_ALLOCATION_INFO info;
+	info.AllocationSize.QuadPart = size;
+	return SetFileInformationByHandle(stream->fd, FileAllocationInfo,
+					  &info, sizeof(info)) != 0;
+#elif defined(__linux__)
+	if (size > 0 &&
+	    fallocate(stream->fd, FALLOC_FL_KEEP_SIZE, 0, (off_t)size) == -1) {
+		return errno == EOPNOTSUPP || errno == ENOSYS;
+	}
+	return 1;
+#else
+	(void)stream;
+	(void)size;
+	return 1;
+#endif
+}
+
+#ifndef _WIN32
+// yielding streams must not block in the kernel, so their fd stays in
+// nonblocking mode while yielding is on, regular files never block anyway
+// the nonblocking setting of the stream is left alone, outside coroutines
+// its reads and writes wait as before
+int stream_set_yielding(ELI_STREAM *stream, int yielding)
+{
+	stream->yielding = yielding;
+	if (stream->fd < 0) {
+		if (!yielding) {
+			return 1;
+		}
+		errno = EBADF;
+		return 0;
+	}
+	if (stream->fd_kind == ELI_STREAM_FD_UNKNOWN) {
+		detect_fd_kind(stream);
+	}
+	return stream->fd_kind == ELI_STREAM_FD_FILE ||
+	       stream_set_nonblocking(stream, yielding || stream->nonblocking);
+}
+
+// readahead needs a regular file read through the fd, depth 0 turns it off
+int stream_set_readahead(ELI_STREAM *stream, size_t depth)
+{
+	if (!pause_readahead(stream)) {
+		return 0;
+	}
+	stream->readahead_depth = 0;
+	if (depth == 0) {
+		return 1;
+	}
+	if (stream->fd < 0) {
+		errno = EBADF;
+		return 0;
+	}
+	if (stream->fd_kind == ELI_STREAM_FD_UNKNOWN) {
+		detect_fd_kind(stream);
+	}
+	// the background read(2) would fail on unaligned direct buffers
+	if (stream->fd_kind != ELI_STREAM_FD_FILE || stream->use_mmap ||
+	    stream->filter != NULL || stream->direct != NULL) {
+		errno = EINVAL;
+		return 0;
+	}
+	stream->readahead_depth = depth; // the first read starts the thread
+	return 1;
+}
+
+// keeps the mapping in sync with the file size, reads call it only once
+// the mapped bytes are used up, so a file may grow while it is mapped but
+// truncating it under unread mapped bytes is not supported (SIGBUS)
+// returns 0 on failure
+static int refresh_map(ELI_STREAM *stream)
+{
+	struct stat st;
+	if (fstat(stream->fd, &st) == -1) {
+		return 0;
+	}
+	size_t size = (size_t)st.st_size;
+	if (size == stream->map_size) {
+		return 1;
+	}
+	if (stream->map != NULL) {
+		munmap(stream->map, stream->map_size);
+		stream->map = NULL;
+	}
+	stream->map_size = 0;
+	if (size > 0) {
+		void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, stream->fd,
+				 0);
+		if (map == MAP_FAILED) {
+			return 0;
+		}
+		madvise(map, size, MADV_SEQUENTIAL);
+		stream->map = map;
+		stream->map_size = size;
+	}
+	if (stream->map_offset > size) {
+		stream->map_offset = size; // truncated under us
+	}
+	return 1;
+}
+
+int stream_enable_map(ELI_STREAM *stream)
+{
+	struct stat st;
+	if (fstat(stream->fd, &st) == -1) {
+		return 0;
+	}
+	if (!S_ISREG(st.st_mode)) {
+		return 1; // only regular files can be mapped, keep reading
+	}
+	stream->use_mmap = 1;
+	return refresh_map(stream);
+}
+
+// regular files only, read ahead data is given back first so the fd
+// offset is where the reader is
+int stream_enable_direct(ELI_STREAM *stream)
+{
+	if (stream->direct != NULL) {
+		return 1;
+	}
+	if (stream->fd_kind == ELI_STREAM_FD_UNKNOWN) {
+		detect_fd_kind(stream);
+	}
+	if (stream->fd_kind != ELI_STREAM_FD_FILE || stream->use_mmap ||
+	    stream->filter != NULL || stream->readahead_depth > 0) {
+		errno = EINVAL;
+		return 0;
+	}
+	if (!stream_flush(stream) || !discard_read_ahead(stream)) {
+		return 0;
+	}
+	stream->direct = stream_direct_new(stream->fd);
+	if (stream->direct == NULL) {
+		return 0;
+	}
+	return stream_set_write_buffering(stream, ELI_STREAM_BUFFERING_FULL,
+					  ELI_STREAM_DIRECT_BUFFER_SIZE);
+}
+#endif
+
+// returns data available without reading the fd, that is either the pending
+// buffer or the unread part of the file mapping
+static const char *peek_buffered(ELI_STREAM *stream, size_t *length)
+{
+#ifndef _WIN32
+	if (stream->use_mmap) {
+		*length = stream->map_size - stream->map_offset;
+		return stream->map + stream->map_offset;
+	}
+#endif
+	*length = stream_buffer_length(&stream->pending);
+	return stream_buffer_data(&stream->pending);
+}
+
+static void skip_buffered(ELI_STREAM *stream, size_t length)
+{
+#ifndef _WIN32
+	if (stream->use_mmap) {
+		// the mapping is read without syscalls, handing data out is
+		// what counts
+		stream->map_offset += length;
+		STREAM_STATS_ADD(stream, bytes_read, length);
+		return;
+	}
+#endif
+	stream_buffer_consume(&stream->pending, length);
+	stream_note_pending(stream);
+}
+
+// data is hashed when it is handed out, read ahead is not part of it yet
+static void consume_buffered(ELI_STREAM *stream, size_t length)
+{
+	if (stream->digest.algo != ELI_STREAM_DIGEST_NONE) {
+		size_t buffered_length;
+		const char *buffered = peek_buffered(stream, &buffered_length);
+		stream_digest_update(&stream->digest, buffered, length);
+	}
+	skip_buffered(stream, length);
+}
+
+// makes up to size more bytes available to peek_buffered
+// returns number of bytes added, 0 on EOF and -1 on error
+static int fill_pending(ELI_STREAM *stream, size_t size, int *out_of_memory)
+{
+	*out_of_memory = 0;
+#ifndef _WIN32
+	if (stream->use_mmap) {
+		size_t available = stream->map_size - stream->map_offset;
+		if (!refresh_map(stream)) {
+			return -1;
+		}
+		size_t now_available = stream->map_size - stream->map_offset;
+		if (now_available <= available) {
+			return 0; // not grown, or truncated under us
+		}
+		size_t added = now_available - available;
+		return added > INT_MAX ? INT_MAX : (int)added;
+	}
+#endif
+	char *p = stream_buffer_reserve(&stream->pending, size);
+	if (p == NULL) {
+		*out_of_memory = 1;
+		set_stream_error(ENOMEM, ERROR_NOT_ENOUGH_MEMORY);
+		return -1;
+	}
+	int res = read_counted(stream, p, size);
+	if (res > 0) {
+		stream_buffer_commit(&stream->pending, res);
+		stream_note_pending(stream);
+	}
+	return res;
+}
+
+static int fill_buffered(lua_State *L, ELI_STREAM *stream, size_t size)
+{
+	int out_of_memory;
+	int res = fill_pending(stream, size, &out_of_memory);
+	if (out_of_memory) {
+		// the error does not return to the binding which set it
+		stream->may_yield = 0;
+		return luaL_error(L, "not enough memory");
+	}
+	return res;
+}
+
+#ifdef ELI_STREAM_ZLIB_SUPPORTED
+// inflates compressed data buffered on the source, the source is refilled
+// in small chunks so memory use does not depend on the data size
+static int read_filtered(ELI_STREAM *stream, char *buffer, size_t size)
+{
+	struct ELI_STREAM_FILTER *filter = stream->filter;
+	ELI_STREAM *source = stream->filter_source;
+	if (source->closed) {
+		set_stream_error(EBADF, ERROR_INVALID_HANDLE);
+		return -1;
+	}
+	if (size > INT_MAX) {
+		size = INT_MAX;
+	}
+	while (size > 0 && !filter->finished) {
+		size_t input_length;
+		const char *input = peek_buffered(source, &input_length);
+		if (input_length == 0) {
+			int out_of_memory;
+			int res = fill_pending(source, STREAM_FILTER_CHUNK_SIZE,
+					       &out_of_memory);
+			if (res == 0) {
+				// the source ended before the compressed data did
+				set_stream_error(EIO, ERROR_HANDLE_EOF);
+				return -1;
+			}
+			if (res < 0) {
+				return -1;
+			}
+			continue;
+		}
+		size_t consumed, produced;
+		int res = stream_filter_process(filter, input, input_length,
+						&consumed, buffer, size,
+						&produced,
+						ELI_STREAM_FILTER_NO_FLUSH);
+		// data behind the end of the compressed stream stays on source
+		consume_buffered(source, consumed);
+		if (res < 0) {
+			set_stream_error(EILSEQ, ERROR_INVALID_DATA);
+			return -1;
+		}
+		if (produced > 0) {
+			return (int)produced;
+		}
+	}
+	return 0;
+}
+
+// hands compressed data to the source, what it can not take right away
+// stays in its write buffer for the next flush
+static int write_to_source(ELI_STREAM *source, const char *data, size_t size)
+{
+	if (source->closed) {
+		set_stream_error(EBADF, ERROR_INVALID_HANDLE);
+		return 0;
+	}
+	ELI_STREAM_IOVEC iov = { (void *)data, size };
+	size_t written;
+	int res = stream_writev(source, &iov, 1, &written);
+	if (res != 0) {
+		return 1;
+	}
+	if (!WOULD_BLOCK) {
+		return 0;
+	}
+	if (!stream_buffer_append(&source->write_buffer, data + written,
+				  size - written)) {
+		set_stream_error(ENOMEM, ERROR_NOT_ENOUGH_MEMORY);
+		return 0;
+	}
+	if (source->digest.algo != ELI_STREAM_DIGEST_NONE) {
+		stream_digest_update(&source->digest, data + written,
+				     size - written);
+	}
+	return 1;
+}
+
+// runs the deflater over input and writes everything it produced
+// with a flush mode it also drains the data zlib holds back
+static int deflate_to_source(ELI_STREAM *stream, const char *input,
+			     size_t length, ELI_STREAM_FILTER_FLUSH flush)
+{
+	char output[STREAM_FILTER_CHUNK_SIZE];
+	for (;;) {
+		size_t consumed, produced;
+		int res = stream_filter_process(stream->filter, input, length,
+						&consumed, output,
+						sizeof(output), &produced,
+						flush);
+		if (res < 0) {
+			set_stream_error(EIO, ERROR_INVALID_DATA);
+			return 0;
+		}
+		input += consumed;
+		length -= consumed;
+		if (produced > 0 &&
+		    !write_to_source(stream->filter_source, output, produced)) {
+			return 0;
+		}
+		// a full output chunk means zlib may have more to give
+		if (res == 0 || (length == 0 && produced < sizeof(output))) {
+			return 1;
+		}
+	}
+}
+
+static int write_filtered(ELI_STREAM *stream, ELI_STREAM_IOVEC *iov,
+			  int iovcnt, size_t *written)
+{
+	*written = 0;
+	if (stream->filter->finished) {
+		set_stream_error(EPIPE, ERROR_BROKEN_PIPE);
+		return 0;
+	}
+	for (int i = 0; i < iovcnt; i++) {
+		if (!deflate_to_source(stream, iov[i].iov_base, iov[i].iov_len,
+				       ELI_STREAM_FILTER_NO_FLUSH)) {
+			return 0;
+		}
+		*written += iov[i].iov_len;
+	}
+	return 1;
+}
+
+// writes out the end of the compressed stream, the source stays open
+static int finish_filter(ELI_STREAM *stream)
+{
+	if (!stream->filter->deflating || stream->filter->finished ||
+	    stream->filter_source->closed) {
+		return 1;
+	}
+	return deflate_to_source(stream, NULL, 0, ELI_STREAM_FILTER_FINISH) &&
+	       stream_flush(stream->filter_source);
+}
+#endif
+
+int stream_sync_filter(ELI_STREAM *stream)
+{
+#ifdef ELI_STREAM_ZLIB_SUPPORTED
+	if (stream->filter == NULL || !stream->filter->deflating ||
+	    stream->filter->finished) {
+		return 1;
+	}
+	// everything written so far becomes decompressible on the other side
+	return deflate_to_source(stream, NULL, 0,
+				 ELI_STREAM_FILTER_SYNC_FLUSH) &&
+	       stream_flush(stream->filter_source);
+#else
+	(void)stream;
+	return 1;
+#endif
+}
+
+// pushes up to length bytes of buffered data and consumes them
+static size_t push_buffered_data(lua_State *L, ELI_STREAM *stream,
+				 size_t length)
+{
+	size_t buffered_length;
+	const char *buffered = peek_buffered(stream, &buffered_length);
+	if (length > buffered_length) {
+		length = buffered_length;
+	}
+	lua_pushlstring(L, buffered, length);
+	consume_buffered(stream, length);
+	return length;
+}
+
+static const char *find_delimiter(const char *data, size_t length,
+				  const char *delimiter,
+				  size_t delimiter_length)
+{
+	if (delimiter_length == 1) {
+		return memchr(data, *delimiter, length);
+	}
+#ifdef _WIN32
+	const char *end = data + length;
+	while (length >= delimiter_length) {
+		const char *p = memchr(data, *delimiter,
+				       length - delimiter_length + 1);
+		if (p == NULL) {
+			return NULL;
+		}
+		if (memcmp(p, delimiter, delimiter_length) == 0) {
+			return p;
+		}
+		data = p + 1;
+		length = end - data;
+	}
+	return NULL;
+#else
+	return memmem(data, length, delimiter, delimiter_length);
+#endif
+}
+
+// reads until the delimiter is buffered
+// returns length of the data including the delimiter or 0 if there is no
+// delimiter because of EOF, timeout or error, see res and timed_out
+static size_t buffer_until(lua_State *L, ELI_STREAM *stream,
+			   const char *delimiter, size_t delimiter_length,
+			   long long deadline, size_t chunk_size, int *res,
+			   int *timed_out)
+{
+	// buffered bytes already known not to start the delimiter
+	size_t scanned = 0;
+	*res = 0;
+	*timed_out = 0;
+	for (;;) {
+		size_t pending_length;
+		const char *pending = peek_buffered(stream, &pending_length);
+		if (pending_length >= scanned + delimiter_length) {
+			const char *found = find_delimiter(
+				pending + scanned, pending_length - scanned,
+				delimiter, delimiter_length);
+			if (found != NULL) {
+				return found - pending + delimiter_length;
+			}
+			// the delimiter may continue in the next chunk
+			scanned = pending_length - delimiter_length + 1;
+		}
+
+		if (*res > 0 && is_deadline_exceeded(deadline)) {
+			*timed_out = 1;
+			return 0;
+		}
+		*res = fill_buffered(L, stream, chunk_size);
+		if (*res > 0) {
+			continue;
+		}
+		if (*res == 0 || !WOULD_BLOCK) {
+			return 0; // EOF or error, data stays buffered on error
+		}
+		if (!wait_readable(stream, deadline)) {
+			*timed_out = 1;
+			return 0;
+		}
+	}
+}
+
+static size_t buffer_line(lua_State *L, ELI_STREAM *stream, long long deadline,
+			  size_t chunk_size, int *res, int *timed_out)
+{
+	return buffer_until(L, stream, "\n", 1, deadline, chunk_size, res,
+			    timed_out);
+}
+
+// pushes length bytes of buffered data without the last chop bytes
+static void push_line(lua_State *L, ELI_STREAM *stream, size_t length,
+		      size_t chop)
+{
+	size_t pending_length;
+	const char *pending = peek_buffered(stream, &pending_length);
+	lua_pushlstring(L, pending, length - chop);
+	consume_buffered(stream, length);
+}
+
+int stream_read_until(lua_State *L, ELI_STREAM *stream, const char *delimiter,
+		      size_t delimiter_length, int keep, int timeout_ms)
+{
+	long long deadline = stream_get_deadline(timeout_ms);
+	start_reads(stream, deadline);
+	int res, timed_out;
+	size_t length = buffer_until(L, stream, delimiter, delimiter_length,
+				     deadline, LUAL_BUFFERSIZE, &res,
+				     &timed_out);
+	end_reads(stream);
+	if (length > 0) {
+		push_line(L, stream, length, keep ? 0 : delimiter_length);
+		return 1;
+	}
+	if (timed_out && stream->yield_interest) {
+		return ELI_STREAM_YIELD;
+	}
+	count_timeout(stream, timed_out);
+	if (res == -1 && !timed_out) {
+		return push_read_result(L, res, 0);
+	}
+	// EOF or timeout, hand out the incomplete record
+	size_t total_read = push_buffered_data(L, stream, SIZE_MAX);
+	return push_read_result(L, total_read > 0 ? total_read : res,
+				timed_out);
+}
+
+static int stream_read_line(lua_State *L, ELI_STREAM *stream, int chop,
+			    int timeout_ms)
+{
+	return stream_read_until(L, stream, "\n", 1, !chop, timeout_ms);
+}
+
+// length of the complete line at the start of the buffer, 0 if none
+static size_t get_buffered_line_length(ELI_STREAM *stream)
+{
+	size_t pending_length;
+	const char *pending = peek_buffered(stream, &pending_length);
+	if (pending_length == 0) {
+		return 0;
+	}
+	const char *end = memchr(pending, '\n', pending_length);
+	return end == NULL ? 0 : (size_t)(end - pending) + 1;
+}
+
+int stream_next_line(lua_State *L, ELI_STREAM *stream, int chop,
+		     int timeout_ms)
+{
+	// a buffered line needs no read
+	size_t buffered_length = get_buffered_line_length(stream);
+	if (buffered_length > 0) {
+		push_line(L, stream, buffered_length, chop);
+		return 1;
+	}
+	long long deadline = stream_get_deadline(timeout_ms);
+	start_reads(stream, deadline);
+	int res, timed_out;
+	size_t line_length = buffer_line(L, stream, deadline,
+					 STREAM_LINES_CHUNK_SIZE, &res,
+					 &timed_out);
+	end_reads(stream);
+	count_timeout(stream, timed_out);
+	if (line_length > 0) {
+		push_line(L, stream, line_length, chop);
+		return 1;
+	}
+	if (res == -1 && !timed_out) {
+		return luaL_error(L, "%s", strerror(errno));
+	}
+	// nil ends a for loop as EOF does, so a timeout can not be reported
+	// as read_line reports it, the incomplete line stays buffered
+	if (timed_out) {
+		return luaL_error(L, "timeout");
+	}
+	size_t pending_length;
+	peek_buffered(stream, &pending_length);
+	if (pending_length == 0) {
+		lua_pushnil(L);
+		return 1;
+	}
+	push_buffered_data(L, stream, SIZE_MAX); // last line without '\n'
+	return 1;
+}
+
+int stream_read_lines(lua_State *L, ELI_STREAM *stream, size_t max_lines,
+		      int timeout_ms)
+{
+	long long deadline = stream_get_deadline(timeout_ms);
+	// the fd is read only once the buffered lines run out, later lines
+	// are taken only when available, so it is polled whatever the timeout
+	int res = 1, timed_out = 0;
+	int reading = 0;
+	size_t line_length = get_buffered_line_length(stream);
+	if (line_length == 0) {
+		start_reads(stream, stream_get_deadline(0));
+		reading = 1;
+		line_length = buffer_line(L, stream, deadline,
+					  STREAM_LINES_CHUNK_SIZE, &res,
+					  &timed_out);
+	}
+	int first_res = res;
+	int first_timed_out = timed_out;
+
+	lua_createtable(L, 0, 0);
+	size_t count = 0;
+	// after the first line take only what is available without waiting
+	long long now = stream_get_deadline(0);
+	while (line_length > 0) {
+		push_line(L, stream, line_length, 1);
+		lua_rawseti(L, -2, ++count);
+		if (count >= max_lines) {
+			break;
+		}
+		line_length = get_buffered_line_length(stream);
+		if (line_length > 0) {
+			continue;
+		}
+		if (!reading) {
+			start_reads(stream, now);
+			reading = 1;
+		}
+		line_length = buffer_line(L, stream, now,
+					  STREAM_LINES_CHUNK_SIZE, &res,
+					  &timed_out);
+	}
+	if (reading) {
+		end_reads(stream);
+	}
+	count_timeout(stream, first_timed_out);
+
+	size_t pending_length;
+	peek_buffered(stream, &pending_length);
+	if (count < max_lines && res == 0 && !timed_out &&
+	    pending_length > 0) {
+		// EOF, the last line has no '\n'
+		push_buffered_data(L, stream, SIZE_MAX);
+		lua_rawseti(L, -2, ++count);
+	}
+	if (count > 0) {
+		return 1;
+	}
+	if (first_res == -1 && !first_timed_out) {
+		return push_read_result(L, first_res, 0);
+	}
+	if (first_timed_out) {
+		return push_read_result(L, 0, 1);
+	}
+	lua_pushnil(L); // EOF
+	return 1;
+}
+
+#ifndef _WIN32
+// bytes between the offset and the end of a regular file, 0 if unknown
+static size_t get_remaining_file_size(ELI_STREAM *stream)
+{
+	if (stream->filter != NULL) {
+		return 0; // the file size says nothing about the inflated size
+	}
+	if (stream->readahead_depth > 0) {
+		return 0; // the fd offset is ahead of the reader
+	}
+	if (stream->fd_kind == ELI_STREAM_FD_UNKNOWN) {
+		detect_fd_kind(stream);
+	}
+	if (stream->fd_kind != ELI_STREAM_FD_FILE) {
+		return 0;
+	}
+	struct stat st;
+	if (fstat(stream->fd, &st) == -1) {
+		return 0;
+	}
+	off_t offset = seek_stream(stream, 0, SEEK_CUR);
+	if (offset == -1 || offset >= st.st_size) {
+		return 0;
+	}
+	return (size_t)(st.st_size - offset);
+}
+#endif
+
+static int stream_read_all(lua_State *L, ELI_STREAM *stream, int timeout_ms)
+{
+#ifndef _WIN32
+	if (stream->use_mmap) {
+		// all of the file is handed out, the mapping has to cover it
+		if (!refresh_map(stream)) {
+			return push_read_result(L, -1, 0);
+		}
+		size_t length = push_buffered_data(L, stream, SIZE_MAX);
+		return push_read_result(L, length, 0);
+	}
+#endif
+	long long deadline = stream_get_deadline(timeout_ms);
+	start_reads(stream, deadline);
+
+	// the data collects in pending and is handed out once, so a yielding
+	// read resumes without copying what it has read so far
+	size_t pending_length;
+	peek_buffered(stream, &pending_length);
+	// the rest of a regular file is reserved at once, one more byte sees
+	// EOF without growing, other streams double the read size as they go
+	size_t target = 0;
+#ifndef _WIN32
+	size_t remaining = get_remaining_file_size(stream);
+	if (remaining > 0 && remaining < SIZE_MAX - pending_length) {
+		target = pending_length + remaining + 1;
+	}
+#endif
+	int res;
+	int timed_out = 0;
+	for (;;) {
+		size_t size;
+		if (target > pending_length) {
+			size = target - pending_length;
+		} else {
+			size = pending_length < LUAL_BUFFERSIZE ? LUAL_BUFFERSIZE :
+			       pending_length < STREAM_READ_ALL_MAX_CHUNK_SIZE ?
+								pending_length :
+								STREAM_READ_ALL_MAX_CHUNK_SIZE;
+		}
+		if (size > INT_MAX) {
+			size = INT_MAX;
+		}
+		res = fill_buffered(L, stream, size);
+		if (res > 0) {
+			pending_length += res;
+			if (is_deadline_exceeded(deadline)) {
+				timed_out = 1;
+				break;
+			}
+			continue;
+		}
+		if (res == 0 || !WOULD_BLOCK) {
+			break;
+		}
+		if (!wait_readable(stream, deadline)) {
+			timed_out = 1;
+			break;
+		}
+	}
+	end_reads(stream);
+	if (timed_out && stream->yield_interest) {
+		return ELI_STREAM_YIELD; // what was read stays in pending
+	}
+	count_timeout(stream, timed_out);
+	size_t total_read = push_buffered_data(L, stream, SIZE_MAX);
+	return push_read_result(L, total_read > 0 ? total_read : res,
+				timed_out);
+}
+
+int stream_read_bytes(lua_State *L, int stream_index, size_t length,
+		      int timeout_ms)
+{
+	ELI_STREAM *stream = (ELI_STREAM *)lua_touserdata(L, stream_index);
+	size_t pending_length;
+	peek_buffered(stream, &pending_length);
+	if (pending_length >= length) {
+		push_buffered_data(L, stream, length);
+		return push_read_result(L, length, 0);
+	}
+
+	long long deadline = stream_get_deadline(timeout_ms);
+	start_reads(stream, deadline);
+
+	int res = 0;
+	int timed_out = 0;
+	while (peek_buffered(stream, &pending_length),
+	       pending_length < length) {
+		if (res > 0 && is_deadline_exceeded(deadline)) {
+			timed_out = 1;
+			break;
+		}
+		res = fill_buffered(L, stream, length - pending_length);
+		if (res > 0) {
+			continue;
+		}
+		if (res == 0 || !WOULD_BLOCK) {
+			break;
+		}
+		if (!wait_readable(stream, deadline)) {
+			timed_out = 1;
+			break;
+		}
+	}
+	end_reads(stream);
+	if (timed_out && stream->yield_interest) {
+		return ELI_STREAM_YIELD;
+	}
+	count_timeout(stream, timed_out);
+	if (res == -1 && !timed_out) {
+		return push_read_result(L, res, 0);
+	}
+	size_t total_read = push_buffered_data(L, stream, length);
+	return push_read_result(L, total_read > 0 ? total_read : res,
+				timed_out);
+}
+
+// reads up to size bytes straight into buffer and returns as soon as there
+// is some data, buffered data is handed out first
+int stream_read_into(lua_State *L, ELI_STREAM *stream, char *buffer,
+		     size_t size, int timeout_ms, size_t *length)
+{
+	*length = 0;
+	size_t pending_length;
+	const char *pending = peek_buffered(stream, &pending_length);
+#ifndef _WIN32
+	// the mapping follows the file size only once it is exhausted
+	if (stream->use_mmap && pending_length == 0 && size > 0) {
+		if (!refresh_map(stream)) {
+			return push_read_result(L, -1, 0);
+		}
+		pending = peek_buffered(stream, &pending_length);
+		if (pending_length == 0) {
+			return push_read_result(L, 0, 0); // end of the file
+		}
+	}
+#endif
+	if (pending_length > 0 || size == 0) {
+		*length = pending_length < size ? pending_length : size;
+		memcpy(buffer, pending, *length);
+		consume_buffered(stream, *length);
+		lua_pushinteger(L, (lua_Integer)*length);
+		return 1;
+	}
+
+	long long deadline = stream_get_deadline(timeout_ms);
+	start_reads(stream, deadline);
+	int res;
+	int timed_out = 0;
+	for (;;) {
+		res = read_counted(stream, buffer, size > INT_MAX ? INT_MAX : size);
+		if (res >= 0) {
+			break;
+		}
+#ifndef _WIN32
+		if (errno == EINTR) {
+			continue;
+		}
+#endif
+		if (!WOULD_BLOCK) {
+			break;
+		}
+		if (!wait_readable(stream, deadline)) {
+			timed_out = 1;
+			break;
+		}
+	}
+	end_reads(stream);
+	if (timed_out && stream->yield_interest) {
+		return ELI_STREAM_YIELD;
+	}
+	count_timeout(stream, timed_out);
+	if (res > 0) {
+		*length = (size_t)res;
+		if (stream->digest.algo != ELI_STREAM_DIGEST_NONE) {
+			stream_digest_update(&stream->digest, buffer, *length);
+		}
+		lua_pushinteger(L, res);
+		return 1;
+	}
+	if (timed_out) {
+		lua_pushinteger(L, 0);
+	}
+	return push_read_result(L, res, timed_out);
+}
+
+int stream_read(lua_State *L, int stream_index, const char *opt, int timeout_ms)
+{
+	ELI_STREAM *stream = (ELI_STREAM *)lua_touserdata(L, stream_index);
+	if (*opt == '*') {
+		opt++; /* skip optional '*' (for compatibility) */
+	}
+	switch (*opt) {
+	case 'l': /* line */
+		return stream_read_line(L, stream, 1, timeout_ms);
+	case 'L': /* line with end-of-line */
+		return stream_read_line(L, stream, 0, timeout_ms);
+	case 'a':
+		return stream_read_all(L, stream,
+				       timeout_ms); /* read all data available */
+	default:
+		return luaL_argerror(L, 2, "invalid format");
+	}
+}
+
+// decodes frame header, returns header length, 0 if the header is not
+// complete yet and -1 if it is malformed
+static int decode_frame_header(ELI_STREAM_FRAME_PREFIX prefix,
+			       const unsigned char *data, size_t length,
+			       unsigned long long *size)
+{
+	switch (prefix) {
+	case ELI_STREAM_FRAME_U32BE:
+		if (length < 4) {
+			return 0;
+		}
+		*size = ((unsigned long long)data[0] << 24) |
+			((unsigned long long)data[1] << 16) |
+			((unsigned long long)data[2] << 8) | data[3];
+		return 4;
+	case ELI_STREAM_FRAME_U32LE:
+		if (length < 4) {
+			return 0;
+		}
+		*size = ((unsigned long long)data[3] << 24) |
+			((unsigned long long)data[2] << 16) |
+			((unsigned long long)data[1] << 8) | data[0];
+		return 4;
+	case ELI_STREAM_FRAME_VARINT:
+	default:
+		*size = 0;
+		for (size_t i = 0; i < STREAM_FRAME_MAX_HEADER_SIZE; i++) {
+			if (i >= length) {
+				return 0;
+			}
+			*size |= (unsigned long long)(data[i] & 0x7f) << (7 * i);
+			if ((data[i] & 0x80) == 0) {
+				return (int)i + 1;
+			}
+		}
+		return -1;
+	}
+}
+
+static int encode_frame_header(ELI_STREAM_FRAME_PREFIX prefix,
+			       unsigned long long size, unsigned char *header)
+{
+	switch (prefix) {
+	case ELI_STREAM_FRAME_U32BE:
+		header[0] = (unsigned char)(size >> 24);
+		header[1] = (unsigned char)(size >> 16);
+		header[2] = (unsigned char)(size >> 8);
+		header[3] = (unsigned char)size;
+		return 4;
+	case ELI_STREAM_FRAME_U32LE:
+		header[0] = (unsigned char)size;
+		header[1] = (unsigned char)(size >> 8);
+		header[2] = (unsigned char)(size >> 16);
+		header[3] = (unsigned char)(size >> 24);
+		return 4;
+	case ELI_STREAM_FRAME_VARINT:
+	default: {
+		int i = 0;
+		do {
+			header[i] = (unsigned char)(size & 0x7f);
+			size >>= 7;
+			if (size != 0) {
+				header[i] |= 0x80;
+			}
+			i++;
+		} while (size != 0);
+		return i;
+	}
+	}
+}
+
+int stream_read_frame(lua_State *L, ELI_STREAM *stream,
+		      ELI_STREAM_FRAME_PREFIX prefix, size_t max_size,
+		      int timeout_ms)
+{
+	if (stream->frame_desync) {
+		set_stream_error(EPROTO, ERROR_INVALID_DATA);
+		return push_error(L, "Frames are out of sync!");
+	}
+	long long deadline = stream_get_deadline(timeout_ms);
+	start_reads(stream, deadline);
+
+	int res = 0;
+	int timed_out = 0;
+	int header_length = 0;
+	unsigned long long size = 0;
+	for (;;) {
+		size_t pending_length;
+		const char *pending = peek_buffered(stream, &pending_length);
+		size_t fill_size;
+		if (stream->frame_skip > 0) {
+			size_t drop = pending_length < stream->frame_skip ?
+					      pending_length :
+					      (size_t)stream->frame_skip;
+			consume_buffered(stream, drop);
+			stream->frame_skip -= drop;
+			if (stream->frame_skip == 0) {
+				continue;
+			}
+			// the dropped body is not kept, it is read in chunks
+			fill_size = stream->frame_skip < LUAL_BUFFERSIZE ?
+					    (size_t)stream->frame_skip :
+					    LUAL_BUFFERSIZE;
+		} else {
+			if (header_length == 0) {
+				header_length = decode_frame_header(
+					prefix, (const unsigned char *)pending,
+					pending_length, &size);
+				if (header_length == -1) {
+					// without the size the next header can
+					// not be found, later reads fail fast
+					end_reads(stream);
+					stream->frame_desync = 1;
+					set_stream_error(EPROTO,
+							 ERROR_INVALID_DATA);
+					return push_error(
+						L, "Invalid frame header!");
+				}
+				if (header_length > 0 && size > max_size) {
+					// the body is dropped by the next reads
+					// so the frames stay in sync
+					end_reads(stream);
+					consume_buffered(stream, header_length);
+					stream->frame_skip = size;
+					set_stream_error(EMSGSIZE,
+							 ERROR_INVALID_DATA);
+					return push_error(
+						L, "Frame is too large!");
+				}
+			}
+			size_t needed = header_length == 0 ?
+						LUAL_BUFFERSIZE :
+						header_length + (size_t)size;
+			if (header_length > 0 && pending_length >= needed) {
+				end_reads(stream);
+				lua_pushlstring(L, pending + header_length,
+						(size_t)size);
+				consume_buffered(stream, needed);
+				return 1;
+			}
+			// once the size is known read the rest of the frame
+			// at once
+			fill_size = header_length == 0 ?
+					    LUAL_BUFFERSIZE :
+					    needed - pending_length;
+		}
+
+		if (res > 0 && is_deadline_exceeded(deadline)) {
+			timed_out = 1;
+			break;
+		}
+		res = fill_buffered(L, stream, fill_size);
+		if (res > 0) {
+			continue;
+		}
+		if (res == 0 || !WOULD_BLOCK) {
+			break;
+		}
+		if (!wait_readable(stream, deadline)) {
+			timed_out = 1;
+			break;
+		}
+	}
+	end_reads(stream);
+	if (timed_out && stream->yield_interest) {
+		return ELI_STREAM_YIELD;
+	}
+	count_timeout(stream, timed_out);
+	if (res == -1 && !timed_out) {
+		return push_read_result(L, res, 0);
+	}
+	// partial frames stay buffered, handing them out would break framing
+	size_t pending_length;
+	peek_buffered(stream, &pending_length);
 	if (timed_out) {
-		// data we read so far
-		lua_pushliteral(L, "timeout");
-		return 2;
+		lua_pushnil(L);
+		return push_read_result(L, 0, 1);
 	}
-
-	switch (res) {
-	case -1:
-		if (!WOULD_BLOCK) {
-			// we push nil only if it's not WOULD_BLOCK
-			// because if it is WOULD_BLOCK, there may be some data later
-			lua_pushnil(L);
-		}
-		push_error_string(L, NULL);
-		lua_pushinteger(L, errno);
-		return 3;
-	case 0:
-		lua_pushnil(L); // EOF
-	default:
-		return 1;
+	if (pending_length > 0 || stream->frame_skip > 0) {
+		return push_error(L, "Stream ended in the middle of a frame!");
 	}
+	lua_pushnil(L); // EOF
+	return 1;
 }
 
-static int get_sleep_per_iteration(int timeout_ms)
+int stream_write_frame(lua_State *L, ELI_STREAM *stream,
+		       ELI_STREAM_FRAME_PREFIX prefix, const char *data,
+		       size_t size)
 {
-	int sleep_per_iteration = timeout_ms / 10;
-	if (sleep_per_iteration <= 0) {
-		sleep_per_iteration = 1; // at least 1 ms
+	if (prefix != ELI_STREAM_FRAME_VARINT && size > 0xffffffffULL) {
+		return push_error(L, "Frame is too large!");
 	}
-	return sleep_per_iteration;
+	unsigned char header[STREAM_FRAME_MAX_HEADER_SIZE];
+	int header_length = encode_frame_header(prefix, size, header);
+	ELI_STREAM_IOVEC iov[2] = { { header, header_length },
+				    { (void *)data, size } };
+	size_t written;
+	int status = stream_writev(stream, iov, 2, &written);
+	return stream_push_write_result(L, status, written);
 }
 
-static int stream_is_nonblocking(ELI_STREAM *stream)
+// moves the position reads and writes continue from, buffered writes are
+// flushed first and read ahead data is dropped unless the new position
+// stays within it, returns the new position or -1
+long long stream_seek(ELI_STREAM *stream, int whence, long long offset)
 {
-#ifndef _WIN32
-	if (stream->fd < 0) {
-		errno = EBADF;
+	if (!stream_flush(stream)) {
 		return -1;
 	}
-	int flags = fcntl(stream->fd, F_GETFL, 0);
-	if (flags < 0) {
+#ifndef _WIN32
+	if (!pause_readahead(stream)) {
 		return -1;
 	}
-	return (flags & O_NONBLOCK) != 0;
+	if (stream->use_mmap) {
+		if (!refresh_map(stream)) {
+			return -1;
+		}
+		long long base = whence == SEEK_SET ? 0 :
+				 whence == SEEK_END ?
+						  (long long)stream->map_size :
+						  (long long)stream->map_offset;
+		if (base + offset < 0) {
+			errno = EINVAL;
+			return -1;
+		}
+		// reads past the end of the mapping are at EOF anyway
+		stream->map_offset = base + offset > (long long)stream->map_size ?
+					     stream->map_size :
+					     (size_t)(base + offset);
+		return (long long)stream->map_offset;
+	}
 #endif
-	return 1;
+	size_t pending = stream_buffer_length(&stream->pending);
+	if (whence == SEEK_CUR && offset >= 0 &&
+	    (unsigned long long)offset <= pending) {
+		long long position = seek_stream(stream, 0, SEEK_CUR);
+		if (position == -1) {
+			return -1;
+		}
+		stream_buffer_consume(&stream->pending, (size_t)offset);
+		stream_note_pending(stream);
+		return position - (long long)(pending - offset);
+	}
+	if (whence == SEEK_CUR) {
+		offset -= (long long)pending; // the fd is ahead by the read ahead
+	}
+	long long position = seek_stream(stream, offset, whence);
+	if (position == -1) {
+		return -1;
+	}
+	stream_buffer_consume(&stream->pending, pending);
+	stream_note_pending(stream);
+	return position;
 }
 
-static int stream_set_nonblocking(ELI_STREAM *stream, int nonblocking)
+// reads up to length bytes at offset, neither the stream position nor
+// the read ahead data are touched
+int stream_read_at(lua_State *L, ELI_STREAM *stream, long long offset,
+		   size_t length)
 {
-#ifndef _WIN32
-	if (stream->fd < 0) {
-		errno = EBADF;
-		return 0;
-	}
-	int flags = fcntl(stream->fd, F_GETFL, 0);
-	if (flags < 0) {
-		return 0;
+	if (!stream_flush(stream)) {
+		return push_read_result(L, -1, 0);
 	}
-	if (((flags & O_NONBLOCK) != 0) != nonblocking) {
-		if (nonblocking) {
-			flags |= O_NONBLOCK;
-		} else {
-			flags &= ~O_NONBLOCK;
+#ifndef _WIN32
+	if (stream->use_mmap) {
+		if (!refresh_map(stream)) {
+			return push_read_result(L, -1, 0);
 		}
-		int res = fcntl(stream->fd, F_SETFL, flags);
-		if (res == -1) {
-			return 0;
+		if (offset >= (long long)stream->map_size) {
+			if (length == 0) {
+				lua_pushliteral(L, "");
+			} else {
+				lua_pushnil(L); // EOF
+			}
+			return 1;
 		}
+		size_t available = stream->map_size - (size_t)offset;
+		lua_pushlstring(L, stream->map + offset,
+				length < available ? length : available);
+		return 1;
 	}
 #endif
+	luaL_Buffer b;
+	char *p = luaL_buffinitsize(L, &b, length);
+	size_t total = 0;
+	while (total < length) {
+		long long res = pread_stream(stream, p + total, length - total,
+					     offset + (long long)total);
+		STREAM_STATS_ADD(stream, read_syscalls, 1);
+		if (res == -1) {
+#ifndef _WIN32
+			if (errno == EINTR) {
+				continue;
+			}
+#endif
+			lua_pop(L, 1); // the buffer
+			return push_read_result(L, -1, 0);
+		}
+		if (res == 0) {
+			break; // EOF
+		}
+		STREAM_STATS_ADD(stream, bytes_read, res);
+		total += res;
+	}
+	luaL_pushresultsize(&b, total);
+	if (total == 0 && length > 0) {
+		lua_pop(L, 1);
+		lua_pushnil(L); // EOF
+	}
 	return 1;
 }
 
-// return 1 if mode was changed, 0 if it was already nonblocking
-static int set_nonblocking(lua_State *L, ELI_STREAM *stream)
+// writes data at offset without moving the stream position, note that
+// appending streams write to the end regardless of offset as pwrite(2) does
+int stream_write_at(lua_State *L, ELI_STREAM *stream, long long offset,
+		    const char *data, size_t size)
 {
-	if (stream_is_nonblocking(stream)) {
-		return 0;
+	if (!stream_flush(stream)) {
+		return stream_push_write_result(L, 0, 0);
 	}
-
-	if (!stream_set_nonblocking(stream, 1)) {
-		return push_error(L, "failed to set nonblocking mode");
+	size_t written = 0;
+	while (written < size) {
+		long long res = pwrite_stream(stream, data + written,
+					      size - written,
+					      offset + (long long)written);
+		count_write(stream, res);
+		if (res == -1) {
+#ifndef _WIN32
+			if (errno == EINTR) {
+				continue;
+			}
+#endif
+			return stream_push_write_result(L, 0, written);
+		}
+		written += res;
 	}
-	return 1;
+	return stream_push_write_result(L, 1, written);
 }
 
-static int restore_blocking_mode(lua_State *L, ELI_STREAM *stream)
+#define STREAM_COPY_CHUNK_SIZE (64 * 1024)
+
+typedef enum ELI_STREAM_COPY_METHOD {
+	STREAM_COPY_BUFFER,
+	STREAM_COPY_SPLICE,
+	STREAM_COPY_FILE_RANGE,
+	STREAM_COPY_SENDFILE
+} ELI_STREAM_COPY_METHOD;
+
+#ifdef __linux__
+// the kernel transfers in the mode of the fds, SPLICE_F_NONBLOCK covers
+// pipes only and regular files do not block
+static int may_block_in_kernel(ELI_STREAM *stream, const struct stat *st)
 {
-	// NOTE: throwing error here is tricky, it would discard the data
-	// so we just ignore the error here right now
-	stream_set_nonblocking(stream, stream->nonblocking);
-	return 1;
+	if (S_ISFIFO(st->st_mode) || S_ISREG(st->st_mode)) {
+		return 0;
+	}
+	refresh_fd_flags(stream);
+	return !(stream->fd_flags & O_NONBLOCK);
 }
 
-static int add_pending_data(lua_State *L, int stream_index, const char *data,
-			    size_t data_len)
+// a copy with a deadline stays in user space if the kernel could block on
+// either fd past it
+static ELI_STREAM_COPY_METHOD get_copy_method(ELI_STREAM *src,
+					      ELI_STREAM *dst,
+					      long long deadline)
 {
-	if (!lua_getiuservalue(L, stream_index, 1)) {
-		lua_pushlstring(L, data, data_len);
-		lua_setiuservalue(L, stream_index, 1);
-		return 1;
+	struct stat src_stat, dst_stat;
+	if (fstat(src->fd, &src_stat) == -1 ||
+	    fstat(dst->fd, &dst_stat) == -1) {
+		return STREAM_COPY_BUFFER;
 	}
-
-	size_t pending_length = 0;
-	const char *pending_data = lua_tolstring(L, -1, &pending_length);
-	if (pending_data == NULL || pending_length == 0) {
-		lua_pushlstring(L, data, data_len);
-		lua_setiuservalue(L, stream_index, 1);
-		return 1;
+	if (deadline != -1 && (may_block_in_kernel(src, &src_stat) ||
+			       may_block_in_kernel(dst, &dst_stat))) {
+		return STREAM_COPY_BUFFER;
 	}
-
-	luaL_Buffer b;
-	luaL_buffinit(L, &b);
-	luaL_addlstring(&b, pending_data, pending_length);
-	luaL_addlstring(&b, data, data_len);
-	luaL_pushresult(&b);
-	lua_setiuservalue(L, stream_index, 1);
-	return 1;
+	if (S_ISFIFO(src_stat.st_mode) || S_ISFIFO(dst_stat.st_mode)) {
+		return STREAM_COPY_SPLICE;
+	}
+	if (S_ISREG(src_stat.st_mode)) {
+		return S_ISREG(dst_stat.st_mode) ? STREAM_COPY_FILE_RANGE :
+						   STREAM_COPY_SENDFILE;
+	}
+	return STREAM_COPY_BUFFER;
 }
 
-static int read_pending_line(lua_State *L, int stream_index, luaL_Buffer *b,
-			     int chop)
+static ssize_t copy_in_kernel(ELI_STREAM_COPY_METHOD method, ELI_STREAM *src,
+			      ELI_STREAM *dst, size_t size)
 {
-	if (lua_getiuservalue(L, stream_index, 1) == LUA_TNONE) {
-		lua_pop(L, 1);
-		return -1;
-	}
-
-	size_t pending_length = 0;
-	const char *pending = lua_tolstring(L, -1, &pending_length);
-	if (pending == NULL || pending_length == 0) {
-		lua_pop(L, 1);
+	switch (method) {
+	case STREAM_COPY_SPLICE:
+		return splice(src->fd, NULL, dst->fd, NULL, size,
+			      SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	case STREAM_COPY_FILE_RANGE:
+		return copy_file_range(src->fd, NULL, dst->fd, NULL, size, 0);
+	case STREAM_COPY_SENDFILE:
+		return sendfile(dst->fd, src->fd, NULL, size);
+	default:
+		errno = ENOSYS;
 		return -1;
 	}
+}
 
-	const char *newline = memchr(pending, '\n', pending_length);
-	if (newline != NULL) {
-		size_t line_length = newline - pending + (chop ? 0 : 1);
-		size_t remaining =
-			pending_length - line_length - (chop ? 1 : 0);
-		memcpy(luaL_prepbuffsize(b, line_length), pending, line_length);
-		lua_pop(L, 1);
-		lua_pushlstring(L, newline + 1, remaining);
-		lua_setiuservalue(L, stream_index, 1); // store remaining data
-		luaL_addsize(b, line_length);
-		return line_length;
-	}
-
-	memcpy(luaL_prepbuffsize(b, pending_length), pending, pending_length);
-	lua_pop(L, 1);
-	lua_pushnil(L);
-	lua_setiuservalue(L, stream_index, 1); // remove pending data
-	luaL_addsize(b, pending_length);
-	return -1; // no newline found
+// errors meaning the kernel can not transfer between this pair of fds
+static int is_copy_unsupported(int error)
+{
+	return error == EINVAL || error == ENOSYS || error == EXDEV ||
+	       error == EOPNOTSUPP || error == EBADF;
 }
+#endif
 
-static int read_all_pending_data(lua_State *L, int stream_index, luaL_Buffer *b)
+static int push_copy_result(lua_State *L, int status, size_t copied,
+			    int timed_out)
 {
-	if (lua_getiuservalue(L, stream_index, 1) == LUA_TNONE) {
-		lua_pop(L, 1);
-		return 0;
+	if (!status) {
+		return stream_push_write_result(L, status, copied);
 	}
-
-	size_t pending_length = 0;
-	const char *pending_data = lua_tolstring(L, -1, &pending_length);
-	if (pending_data == NULL || pending_length == 0) {
-		lua_pop(L, 1);
-		return 0;
+	lua_pushinteger(L, (lua_Integer)copied);
+	if (timed_out) {
+		lua_pushliteral(L, "timeout");
+		return 2;
 	}
-
-	memcpy(luaL_prepbuffsize(b, pending_length), pending_data,
-	       pending_length);
-	lua_pop(L, 1);
-	lua_pushnil(L);
-	lua_setiuservalue(L, stream_index, 1); // store pending data
-	luaL_addsize(b, pending_length);
-	return pending_length;
+	return 1;
 }
 
-static int stream_read_line(lua_State *L, int stream_index, int chop,
-			    int timeout_ms)
+int stream_copy(lua_State *L, ELI_STREAM *src, ELI_STREAM *dst, size_t length,
+		int timeout_ms)
 {
-	size_t res;
-	luaL_Buffer b;
-	luaL_buffinit(L, &b);
-
-	long long start_time = get_time_in_ms();
-	int sleep_per_iteration =
-		timeout_ms == -1 ? 100 : get_sleep_per_iteration(timeout_ms);
-
-	ELI_STREAM *stream = (ELI_STREAM *)lua_touserdata(L, stream_index);
-	set_nonblocking(L, stream);
+	if (!stream_flush(dst)) {
+		return push_copy_result(L, 0, 0, 0);
+	}
+#ifndef _WIN32
+	if (!pause_readahead(dst)) {
+		return push_copy_result(L, 0, 0, 0);
+	}
+#endif
+	long long deadline = stream_get_deadline(timeout_ms);
+	start_reads(src, deadline);
 
-	size_t total_read = 0;
+	ELI_STREAM_COPY_METHOD method = STREAM_COPY_BUFFER;
+#ifdef __linux__
+	// mapped and prefetched files are written from memory, filters and
+	// digests have to see the data, direct files need aligned transfers
+	if (!src->use_mmap && src->readahead_depth == 0 &&
+	    src->direct == NULL && dst->direct == NULL &&
+	    src->filter == NULL && dst->filter == NULL &&
+	    src->digest.algo == ELI_STREAM_DIGEST_NONE &&
+	    dst->digest.algo == ELI_STREAM_DIGEST_NONE) {
+		method = get_copy_method(src, dst, deadline);
+	}
+#endif
+#ifndef _WIN32
+	if (src->use_mmap && !refresh_map(src)) {
+		end_reads(src);
+		return push_copy_result(L, 0, 0, 0);
+	}
+#endif
+	size_t copied = 0;
+	int status = 1;
 	int timed_out = 0;
-	do {
-		int line_length = read_pending_line(L, stream_index, &b, chop);
-		if (line_length >= 0) {
-			total_read += line_length;
-			break;
+	int progressed = 0;
+	while (copied < length) {
+		// buffered data goes first, the buffer copy also stages there
+		size_t pending_length;
+		const char *pending = peek_buffered(src, &pending_length);
+		if (pending_length > 0) {
+			ELI_STREAM_IOVEC iov = {
+				(void *)pending, pending_length < length - copied ?
+							 pending_length :
+							 length - copied
+			};
+			size_t written;
+			int ok = write_all(dst, &iov, 1, &written);
+			if (dst->digest.algo != ELI_STREAM_DIGEST_NONE) {
+				stream_digest_update(&dst->digest, pending,
+						     written);
+			}
+			consume_buffered(src, written);
+			copied += written;
+			if (ok) {
+				continue;
+			}
+			if (!WOULD_BLOCK) {
+				status = 0;
+				break;
+			}
+			if (!wait_streams(NULL, dst, deadline)) {
+				timed_out = 1;
+				break;
+			}
+			continue;
 		}
 
-		char *buff = luaL_prepbuffsize(&b, LUAL_BUFFERSIZE);
-		res = read_stream(stream, buff, LUAL_BUFFERSIZE);
-		if (res == -1) {
-			if (WOULD_BLOCK) {
-				sleep_ms(sleep_per_iteration);
-				goto TIMEOUT_CHECK;
+		if (progressed && is_deadline_exceeded(deadline)) {
+			timed_out = 1;
+			break;
+		}
+		size_t chunk = length - copied < STREAM_COPY_CHUNK_SIZE ?
+				       length - copied :
+				       STREAM_COPY_CHUNK_SIZE;
+		long long res = 0;
+		if (method == STREAM_COPY_BUFFER) {
+			res = fill_buffered(L, src, chunk);
+		} else {
+#ifdef __linux__
+			res = copy_in_kernel(method, src, dst, chunk);
+			if (res == -1 && is_copy_unsupported(errno)) {
+				method = STREAM_COPY_BUFFER;
+				continue;
 			}
-			return push_read_result(L, res, 0);
+			// one syscall moves the data out of src and into dst
+			STREAM_STATS_ADD(src, read_syscalls, 1);
+			count_write(dst, res);
+			if (res > 0) {
+				STREAM_STATS_ADD(src, bytes_read, res);
+				copied += res;
+			}
+#endif
+		}
+		progressed = res > 0;
+		if (res > 0) {
+			continue;
 		}
 		if (res == 0) {
-			// EOF, add pending data if any
-			res = read_all_pending_data(L, stream_index, &b);
-			break;
+			break; // EOF
 		}
-
-		char *new_line = memchr(buff, '\n', res);
-		if (new_line != NULL) {
-			size_t line_length = new_line - buff + (chop ? 0 : 1);
-			size_t remaining = res - line_length - (chop ? 1 : 0);
-			luaL_addsize(&b, line_length);
-			total_read += line_length;
-			// the rest of the data without '\n'
-			add_pending_data(L, stream_index, new_line + 1,
-					 remaining);
+#ifndef _WIN32
+		if (errno == EINTR) {
+			continue;
+		}
+#endif
+		if (!WOULD_BLOCK) {
+			status = 0;
 			break;
 		}
-		luaL_addsize(&b, res);
-		total_read += res;
-
-TIMEOUT_CHECK:
-
-		if (timeout_ms != -1 &&
-		    start_time + timeout_ms < get_time_in_ms()) {
+		// we do not know which side would block, so wait for both
+		if (!wait_streams(src,
+				  method == STREAM_COPY_BUFFER ? NULL : dst,
+				  deadline)) {
 			timed_out = 1;
 			break;
 		}
-	} while (res != 0);
-	luaL_pushresult(&b);
-	restore_blocking_mode(L, stream);
-	return push_read_result(L, total_read > 0 ? total_read : res,
-				timed_out);
+	}
+	end_reads(src);
+	count_timeout(src, timed_out);
+	return push_copy_result(L, status, copied, timed_out);
 }
 
-static int stream_read_all(lua_State *L, int stream_index, int timeout_ms)
+#ifndef _WIN32
+// tee targets must not block whatever their kind, the policy decides what
+// happens when they would, regular files never block anyway
+static void set_target_nonblocking(ELI_STREAM *stream, int nonblocking)
 {
-	luaL_Buffer b;
-	luaL_buffinit(L, &b);
-	read_all_pending_data(L, stream_index, &b);
+	if (stream->filter_source != NULL) {
+		set_target_nonblocking(stream->filter_source, nonblocking);
+		return;
+	}
+	if (stream->fd < 0) {
+		return;
+	}
+	if (stream->fd_kind == ELI_STREAM_FD_UNKNOWN) {
+		detect_fd_kind(stream);
+	}
+	if (stream->fd_kind != ELI_STREAM_FD_FILE) {
+		stream_set_nonblocking(stream, nonblocking ||
+							       stream->nonblocking ||
+							       stream->yielding);
+	}
+}
+#endif
 
-	size_t res;
-	ELI_STREAM *stream = (ELI_STREAM *)lua_touserdata(L, stream_index);
-	set_nonblocking(L, stream);
+// the data is written by the next write or flush of the target
+static int queue_for_target(ELI_STREAM *target, const char *data, size_t size)
+{
+	if (!stream_buffer_append(&target->write_buffer, data, size)) {
+		set_stream_error(ENOMEM, ERROR_NOT_ENOUGH_MEMORY);
+		return 0;
+	}
+	if (target->digest.algo != ELI_STREAM_DIGEST_NONE) {
+		stream_digest_update(&target->digest, data, size);
+	}
+	return 1;
+}
 
-	long long start_time = get_time_in_ms();
-	int sleep_per_iteration =
-		timeout_ms == -1 ? 100 : get_sleep_per_iteration(timeout_ms);
-	size_t total_read = 0;
-	int timed_out = 0;
-	do {
-		char *p = luaL_prepbuffsize(&b, LUAL_BUFFERSIZE);
-		res = read_stream(stream, p, LUAL_BUFFERSIZE);
-		if (res == -1) { // read some data
-			if (WOULD_BLOCK) {
-				sleep_ms(sleep_per_iteration);
-				goto TIMEOUT_CHECK;
+// hands data to one target, a target that would block is waited for,
+// skipped or queued for as the policy says, once the deadline passed the
+// rest is queued, so no target misses data or gets it twice
+// returns 0 on failure
+static int tee_deliver(ELI_STREAM *target, const char *data, size_t size,
+		       ELI_STREAM_TEE_POLICY policy, size_t limit,
+		       long long deadline, int *timed_out)
+{
+	size_t offset = 0;
+	while (offset < size && !*timed_out) {
+		// data queued before keeps its place
+		if (stream_buffer_length(&target->write_buffer) > 0 &&
+		    !stream_flush(target) && !WOULD_BLOCK) {
+			return 0;
+		}
+		size_t queued = stream_buffer_length(&target->write_buffer);
+		if (queued == 0) {
+			ELI_STREAM_IOVEC iov = { (void *)(data + offset),
+						 size - offset };
+			size_t written;
+			int ok = write_all(target, &iov, 1, &written);
+			if (target->digest.algo != ELI_STREAM_DIGEST_NONE) {
+				stream_digest_update(&target->digest,
+						     data + offset, written);
+			}
+			offset += written;
+			if (ok) {
+				return 1;
+			}
+			if (!WOULD_BLOCK) {
+				return 0;
 			}
-			break;
 		}
-		luaL_addsize(&b, res);
-		total_read += res;
-TIMEOUT_CHECK:
-		if (timeout_ms != -1 &&
-		    start_time + timeout_ms < get_time_in_ms()) {
-			timed_out = 1;
+		if (policy == ELI_STREAM_TEE_DROP) {
+			STREAM_STATS_ADD(target, bytes_dropped, size - offset);
+			return 1;
+		}
+		if (policy == ELI_STREAM_TEE_BUFFER &&
+		    queued + size - offset <= limit) {
 			break;
 		}
-	} while (res != 0);
-	luaL_pushresult(&b);
-	restore_blocking_mode(L, stream);
-	return push_read_result(L, total_read > 0 ? total_read : res,
-				timed_out);
+		if (!wait_streams(NULL, target, deadline)) {
+			*timed_out = 1;
+		}
+	}
+	return offset == size ||
+	       queue_for_target(target, data + offset, size - offset);
 }
 
-static int read_pending_bytes(lua_State *L, int stream_index, size_t lengh,
-			      luaL_Buffer *b)
+#ifdef __linux__
+// tee(2) duplicates a pipe into other pipes without consuming it
+static int can_tee_in_kernel(ELI_STREAM *src, ELI_STREAM **targets, int count)
 {
-	if (lua_getiuservalue(L, stream_index, 1) == LUA_TNONE) {
-		lua_pop(L, 1);
+	struct stat st;
+	if (src->use_mmap || src->readahead_depth > 0 || src->direct != NULL ||
+	    src->filter != NULL || src->digest.algo != ELI_STREAM_DIGEST_NONE ||
+	    fstat(src->fd, &st) == -1 || !S_ISFIFO(st.st_mode)) {
 		return 0;
 	}
-
-	size_t pending_length = 0;
-	const char *pending_data = lua_tolstring(L, -1, &pending_length);
-	if (pending_data == NULL || pending_length == 0) {
-		lua_pop(L, 1);
-		return 0;
+	for (int i = 0; i < count; i++) {
+		if (targets[i]->filter != NULL ||
+		    targets[i]->digest.algo != ELI_STREAM_DIGEST_NONE ||
+		    fstat(targets[i]->fd, &st) == -1 || !S_ISFIFO(st.st_mode)) {
+			return 0;
+		}
 	}
-
-	size_t copy_length = lengh < pending_length ? lengh : pending_length;
-	memcpy(luaL_prepbuffsize(b, copy_length), pending_data, copy_length);
-	lua_pop(L, 1);
-	lua_pushlstring(L, pending_data + copy_length,
-			pending_length - copy_length);
-	lua_setiuservalue(L, stream_index, 1); // store pending data
-	luaL_addsize(b, copy_length);
-	return copy_length;
+	return 1;
 }
 
-int stream_read_bytes(lua_State *L, int stream_index, size_t length,
-		      int timeout_ms)
+// duplicates up to size bytes of the src pipe into all targets but the last
+// with tee(2) and moves them into the last one with splice(2), what some
+// target could not take is read into the src buffer and delivered from there
+// returns like fill_buffered, data left in the src buffer is not counted
+static long long tee_in_kernel(lua_State *L, ELI_STREAM *src,
+			       ELI_STREAM **targets, int count, size_t size,
+			       size_t *teed, ELI_STREAM_TEE_POLICY policy,
+			       size_t limit, long long deadline,
+			       int *timed_out, size_t *copied)
 {
-	luaL_Buffer b;
-	luaL_buffinit(L, &b);
-	int cached = read_pending_bytes(L, stream_index, length, &b);
-	if (length == cached) {
-		luaL_pushresult(&b);
-		return push_read_result(L, cached, 0);
+	int available = 0;
+	if (ioctl(src->fd, FIONREAD, &available) == -1 || available <= 0) {
+		// empty or at EOF, a plain read tells which
+		return fill_buffered(L, src, size);
 	}
-	length -= cached;
-
-	size_t res;
-	ELI_STREAM *stream = (ELI_STREAM *)lua_touserdata(L, stream_index);
-	set_nonblocking(L, stream);
+	size_t n = (size_t)available < size ? (size_t)available : size;
+	int shortfall = 0;
+	for (int i = 0; i < count - 1; i++) {
+		teed[i] = 0;
+		// data queued before keeps its place
+		if (stream_buffer_length(&targets[i]->write_buffer) > 0) {
+			shortfall = 1;
+			continue;
+		}
+		ssize_t res;
+		do {
+			res = tee(src->fd, targets[i]->fd, n, SPLICE_F_NONBLOCK);
+		} while (res == -1 && errno == EINTR);
+		count_write(targets[i], res);
+		if (res == -1 && !WOULD_BLOCK && !is_copy_unsupported(errno)) {
+			return -1;
+		}
+		if (res > 0) {
+			teed[i] = (size_t)res;
+		}
+		shortfall |= teed[i] < n;
+	}
+	ELI_STREAM *last = targets[count - 1];
+	size_t spliced = 0;
+	if (!shortfall && stream_buffer_length(&last->write_buffer) == 0) {
+		ssize_t res;
+		do {
+			res = splice(src->fd, NULL, last->fd, NULL, n,
+				     SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		} while (res == -1 && errno == EINTR);
+		count_write(last, res);
+		STREAM_STATS_ADD(src, read_syscalls, 1);
+		if (res == -1 && !WOULD_BLOCK && !is_copy_unsupported(errno)) {
+			return -1;
+		}
+		if (res > 0) {
+			STREAM_STATS_ADD(src, bytes_read, res);
+			spliced = (size_t)res;
+		}
+	}
+	*copied += spliced;
+	if (spliced == n) {
+		return (long long)n;
+	}
+	// the rest is still in the pipe, behind what was spliced
+	long long res = fill_buffered(L, src, n - spliced);
+	if (res <= 0) {
+		return spliced > 0 ? (long long)spliced : res;
+	}
+	size_t length;
+	const char *data = peek_buffered(src, &length);
+	for (int i = 0; i < count - 1; i++) {
+		// only complete tees let the splice happen, so none is behind
+		size_t skip = teed[i] - spliced;
+		if (skip < length &&
+		    !tee_deliver(targets[i], data + skip, length - skip,
+				 policy, limit, deadline, timed_out)) {
+			return -1;
+		}
+	}
+	if (!tee_deliver(last, data, length, policy, limit, deadline,
+			 timed_out)) {
+		return -1;
+	}
+	consume_buffered(src, length);
+	*copied += length;
+	return (long long)(spliced + length);
+}
+#endif
 
-	long long start_time = get_time_in_ms();
-	int sleep_per_iteration =
-		timeout_ms == -1 ? 100 : get_sleep_per_iteration(timeout_ms);
+int stream_tee(lua_State *L, ELI_STREAM *src, ELI_STREAM **targets,
+	       int count, size_t length, ELI_STREAM_TEE_POLICY policy,
+	       size_t limit, int timeout_ms)
+{
+	size_t *teed = NULL;
+#ifdef __linux__
+	int use_tee = can_tee_in_kernel(src, targets, count);
+	if (use_tee) {
+		teed = (size_t *)lua_newuserdatauv(L, sizeof(size_t) * count,
+						   0);
+	}
+#else
+	(void)teed;
+#endif
+	long long deadline = stream_get_deadline(timeout_ms);
+	start_reads(src, deadline);
+	int status = 1;
+	for (int i = 0; i < count; i++) {
+#ifndef _WIN32
+		set_target_nonblocking(targets[i], 1);
+		if (!pause_readahead(targets[i])) {
+			status = 0;
+		}
+#endif
+		// data queued by an earlier tee may stay, it is written first
+		if (!stream_flush(targets[i]) && !WOULD_BLOCK) {
+			status = 0;
+		}
+	}
 
-	char *p = luaL_prepbuffsize(&b, length);
-	size_t total_read = 0;
+	size_t copied = 0;
 	int timed_out = 0;
-	do {
-		res = read_stream(stream, p + total_read, length - total_read);
-		if (res == -1) { // read some data
-			if (WOULD_BLOCK) {
-				sleep_ms(sleep_per_iteration);
-				goto TIMEOUT_CHECK;
+	int progressed = 0;
+	while (status && !timed_out && copied < length) {
+		// buffered data goes first, the buffer method also stages there
+		size_t pending_length;
+		const char *pending = peek_buffered(src, &pending_length);
+		if (pending_length > 0) {
+			size_t size = pending_length < length - copied ?
+					      pending_length :
+					      length - copied;
+			for (int i = 0; i < count && status; i++) {
+				status = tee_deliver(targets[i], pending, size,
+						     policy, limit, deadline,
+						     &timed_out);
 			}
+			consume_buffered(src, size);
+			copied += size;
+			continue;
+		}
+
+		if (progressed && is_deadline_exceeded(deadline)) {
+			timed_out = 1;
 			break;
 		}
-		luaL_addsize(&b, res);
-		total_read += res;
-		if (total_read == length) {
+		size_t chunk = length - copied < STREAM_COPY_CHUNK_SIZE ?
+				       length - copied :
+				       STREAM_COPY_CHUNK_SIZE;
+		long long res;
+#ifdef __linux__
+		if (use_tee) {
+			res = tee_in_kernel(L, src, targets, count, chunk, teed,
+					    policy, limit, deadline,
+					    &timed_out, &copied);
+		} else
+#endif
+		{
+			res = fill_buffered(L, src, chunk);
+		}
+		progressed = res > 0;
+		if (res > 0) {
+			continue;
+		}
+		if (res == 0) {
+			break; // EOF
+		}
+#ifndef _WIN32
+		if (errno == EINTR) {
+			continue;
+		}
+#endif
+		if (!WOULD_BLOCK) {
+			status = 0;
 			break;
 		}
-TIMEOUT_CHECK:
-		if (timeout_ms != -1 &&
-		    start_time + timeout_ms < get_time_in_ms()) {
+		if (!wait_streams(src, NULL, deadline)) {
 			timed_out = 1;
 			break;
 		}
-	} while (res != 0);
-	luaL_pushresult(&b);
-	restore_blocking_mode(L, stream);
-	return push_read_result(L, total_read > 0 ? total_read : res,
-				timed_out);
-}
-
-int stream_read(lua_State *L, int stream_index, const char *opt, int timeout_ms)
-{
-	size_t success;
-	if (*opt == '*') {
-		opt++; /* skip optional '*' (for compatibility) */
 	}
-	switch (*opt) {
-	case 'l': /* line */
-		return stream_read_line(L, stream_index, 1, timeout_ms);
-	case 'L': /* line with end-of-line */
-		return stream_read_line(L, stream_index, 0, timeout_ms);
-	case 'a':
-		return stream_read_all(
-			L, stream_index,
-			timeout_ms); /* read all data available */
-	default:
-		return luaL_argerror(L, 2, "invalid format");
+	end_reads(src);
+#ifndef _WIN32
+	for (int i = 0; i < count; i++) {
+		set_target_nonblocking(targets[i], 0);
 	}
+#endif
+	count_timeout(src, timed_out);
+	return push_copy_result(L, status, copied, timed_out);
 }
 
 ELI_STREAM *eli_new_stream(lua_State *L)
@@ -436,6 +2792,10 @@ ELI_STREAM *eli_new_stream(lua_State *L)
 		memset(stream, 0, sizeof(ELI_STREAM));
 	}
 	stream->fd = STREAM_FD_DEFAULT;
+	stream->write_watermark = ELI_STREAM_DEFAULT_WRITE_WATERMARK;
+#ifdef __linux__
+	stream->reactor_fd = -1;
+#endif
 	return stream;
 }
 
@@ -445,6 +2805,48 @@ int eli_stream_close(ELI_STREAM *stream)
 		return 1;
 	}
 	stream->closed = 1;
+#ifndef _WIN32
+	// the thread has to be gone before the fd is closed
+	pause_readahead(stream);
+	stream->readahead_depth = 0;
+#endif
+	// buffered data is still written even if the stream is not disposable,
+	// close is also the finalizer so it never waits for a nonblocking fd,
+	// data queued by nonblocking writes which does not fit now is lost and
+	// close fails, drain() first to wait for it
+	int flushed = stream->fd == STREAM_FD_DEFAULT || stream_flush(stream);
+#ifdef ELI_STREAM_ZLIB_SUPPORTED
+	if (stream->filter != NULL) {
+		flushed = finish_filter(stream) && flushed;
+		stream_filter_free(stream->filter);
+		stream->filter = NULL;
+	}
+#endif
+	stream_buffer_free(&stream->write_buffer);
+	stream_buffer_free(&stream->pending);
+	stream_note_pending(stream);
+#ifdef __linux__
+	// a dup()ed fd would keep the registration and its events alive
+	if (stream->reactor_fd != -1) {
+		epoll_ctl(stream->reactor_fd, EPOLL_CTL_DEL, stream->fd, NULL);
+		stream->reactor_fd = -1;
+	}
+#endif
+#ifndef _WIN32
+	if (stream->drop_cache_after && stream->drop_cache_pending > 0) {
+		// whatever was read since the last step
+		drop_cache_behind(stream, STREAM_DROP_CACHE_CHUNK_SIZE);
+	}
+	if (stream->direct != NULL) {
+		stream_direct_free(stream->direct);
+		stream->direct = NULL;
+	}
+	if (stream->map != NULL) {
+		munmap(stream->map, stream->map_size);
+		stream->map = NULL;
+		stream->map_size = 0;
+	}
+#endif
 	if (!stream->not_disposable) {
 #ifdef _WIN32
 		if (stream->overlapped_buffer != NULL) {
@@ -471,5 +2873,5 @@ int eli_stream_close(ELI_STREAM *stream)
 		}
 #endif
 	}
-	return 1;
+	return flushed;
 }
\ No newline at end of file
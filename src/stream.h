@@ -2,17 +2,78 @@
 #define ELI_STREAM_EXTRA_H__
 
 #include "lua.h"
+#include "stream_buffer.h"
+#include "stream_digest.h"
 
 #ifdef _WIN32
 #include <windows.h>
 #else
 #include <unistd.h>
+#include <sys/uio.h>
 #endif
 
 #define ELI_STREAM_R_METATABLE "ELI_STREAM_R"
 #define ELI_STREAM_W_METATABLE "ELI_STREAM_W"
 #define ELI_STREAM_RW_METATABLE "ELI_STREAM_RW"
 
+#ifdef _WIN32
+typedef struct ELI_STREAM_IOVEC {
+	void *iov_base;
+	size_t iov_len;
+} ELI_STREAM_IOVEC;
+#else
+typedef struct iovec ELI_STREAM_IOVEC;
+#endif
+
+typedef enum ELI_STREAM_BUFFERING {
+	ELI_STREAM_BUFFERING_NO,
+	ELI_STREAM_BUFFERING_FULL,
+	ELI_STREAM_BUFFERING_LINE
+} ELI_STREAM_BUFFERING;
+
+typedef enum ELI_STREAM_FRAME_PREFIX {
+	ELI_STREAM_FRAME_U32BE,
+	ELI_STREAM_FRAME_U32LE,
+	ELI_STREAM_FRAME_VARINT
+} ELI_STREAM_FRAME_PREFIX;
+
+// what tee does with a target that can not take more data right now
+typedef enum ELI_STREAM_TEE_POLICY {
+	ELI_STREAM_TEE_BLOCK, // wait for it
+	ELI_STREAM_TEE_DROP, // the target misses the data
+	ELI_STREAM_TEE_BUFFER // queue up to a limit per target, then wait
+} ELI_STREAM_TEE_POLICY;
+
+// counters are plain, a stream is used from one thread at a time
+typedef struct ELI_STREAM_STATS {
+	unsigned long long bytes_read;
+	unsigned long long bytes_written;
+	unsigned long long read_syscalls;
+	unsigned long long write_syscalls;
+	unsigned long long would_block; // EAGAIN hits
+	unsigned long long wait_us; // time spent waiting for readiness
+	unsigned long long timeouts; // operations ended by their timeout
+	size_t pending_peak;
+	unsigned long long bytes_dropped; // skipped by tee's drop policy
+} ELI_STREAM_STATS;
+
+// streams of a reactor with buffered data, that data does not wake up
+// epoll so the reactor reports them by itself, see lreactor.c
+typedef struct ELI_STREAM_READY_LIST {
+	struct ELI_STREAM *head;
+	int count;
+} ELI_STREAM_READY_LIST;
+
+#ifndef _WIN32
+// decides how reads avoid blocking without flipping O_NONBLOCK
+typedef enum ELI_STREAM_FD_KIND {
+	ELI_STREAM_FD_UNKNOWN, // not inspected yet
+	ELI_STREAM_FD_FILE, // regular file, reads do not block
+	ELI_STREAM_FD_SOCKET, // read with MSG_DONTWAIT
+	ELI_STREAM_FD_OTHER // pipes, ttys..., polled unless the fd is nonblocking
+} ELI_STREAM_FD_KIND;
+#endif
+
 typedef struct ELI_STREAM {
 #ifdef _WIN32
 	HANDLE fd;
@@ -23,10 +84,70 @@ typedef struct ELI_STREAM {
 	int overlapped_pending;
 #else
 	int fd;
+	// read-only mapping of a regular file served instead of read(2)
+	int use_mmap;
+	char *map;
+	size_t map_size;
+	size_t map_offset;
+	ELI_STREAM_FD_KIND fd_kind;
+	// F_GETFL flags of the fd as last seen or set by the stream
+	int fd_flags;
+	// the open file description is shared with a clone, see clone_stream
+	int shared_fd;
+	// set while reads of a blocking fd must not wait, the fd is polled
+	int poll_reads;
+	// background prefetch of regular files, see stream_readahead.h
+	// the thread runs only between reads and seeks/writes/close
+	struct ELI_STREAM_READAHEAD *readahead;
+	size_t readahead_depth;
+	// uncached I/O through aligned buffers, see stream_direct.h
+	struct ELI_STREAM_DIRECT *direct;
+	// read data is dropped from the page cache behind the fd offset
+	int drop_cache_after;
+	size_t drop_cache_pending; // bytes read since the last drop
 #endif
 	int closed;
 	int nonblocking;
 	int not_disposable;
+	// data read from the fd but not consumed yet
+	ELI_STREAM_BUFFER pending;
+	// body bytes of an oversized frame read_frame drops before it looks
+	// for the next header
+	unsigned long long frame_skip;
+	// a malformed frame header was read, the next frame can not be found
+	int frame_desync;
+	// data written by the user but not passed to the fd yet
+	ELI_STREAM_BUFFER write_buffer;
+	size_t write_buffer_size;
+	ELI_STREAM_BUFFERING write_buffering;
+	ELI_STREAM_STATS stats;
+	// would-block operations yield the running coroutine, see lstream.c
+	// the fd is kept nonblocking meanwhile, nonblocking stays the user's
+	int yielding;
+	// set by the bindings while the running operation may yield
+	int may_yield;
+	// 'r' or 'w' the last operation stopped on to yield, 0 otherwise
+	int yield_interest;
+	// set by the bindings while a nonblocking write may queue what the fd
+	// does not take, the queue is the write buffer, see write_queued
+	int may_queue;
+	size_t write_watermark; // most bytes the queue accepts
+	// compression filter streams (de)compress data of their source stream
+	// and share its fd, see stream_zlib.h
+	struct ELI_STREAM_FILTER *filter;
+	struct ELI_STREAM *filter_source;
+	// running digest of the data read and written, off unless enabled
+	struct ELI_STREAM_DIGEST digest;
+	// the stream is linked into the list of the reactor it is read through
+	// while it has buffered data, see stream_note_pending
+	ELI_STREAM_READY_LIST *ready_list;
+	struct ELI_STREAM *ready_prev;
+	struct ELI_STREAM *ready_next;
+#ifdef __linux__
+	// epoll fd of the reactor the stream is registered with, -1 if none,
+	// close removes the registration before the fd goes, see lreactor.c
+	int reactor_fd;
+#endif
 } ELI_STREAM;
 
 typedef enum ELI_STREAM_KIND {
@@ -36,12 +157,82 @@ typedef enum ELI_STREAM_KIND {
 	ELI_STREAM_INVALID_KIND
 } ELI_STREAM_KIND;
 
+// module wide aggregate of all streams, collected only when enabled
+extern ELI_STREAM_STATS stream_global_stats;
+extern int stream_global_stats_enabled;
+
+#define STREAM_STATS_ADD(stream, field, n)                \
+	do {                                              \
+		(stream)->stats.field += (n);             \
+		if (stream_global_stats_enabled) {        \
+			stream_global_stats.field += (n); \
+		}                                         \
+	} while (0)
+
+// returned instead of the number of results when an operation stopped
+// because it may yield, the partial progress stays buffered in the stream
+#define ELI_STREAM_YIELD -1
+// returned by queueing writes when the queue is full, the number of bytes
+// accepted is reported as for a failed write
+#define ELI_STREAM_WOULD_BLOCK -2
+
+#define ELI_STREAM_DEFAULT_WRITE_WATERMARK (1024 * 1024)
+
+void stream_note_pending(ELI_STREAM *stream);
+// accounts a read(2) of the fd made outside of the stream, errno is set
+// as after the read if res is -1
+void stream_count_read(ELI_STREAM *stream, int res);
+// whether a plain read(2) of the fd into pending is what a read of the
+// stream would do
+int stream_reads_fd_directly(ELI_STREAM *stream);
+void stream_set_ready_list(ELI_STREAM *stream, ELI_STREAM_READY_LIST *list);
+long long stream_get_deadline(int timeout_ms);
+int stream_get_remaining_ms(long long deadline);
 int stream_read(lua_State *L, int stream_index, const char *opt,
 		int timeout_ms);
+int stream_read_until(lua_State *L, ELI_STREAM *stream, const char *delimiter,
+		      size_t delimiter_length, int keep, int timeout_ms);
+int stream_next_line(lua_State *L, ELI_STREAM *stream, int chop,
+		     int timeout_ms);
+int stream_read_lines(lua_State *L, ELI_STREAM *stream, size_t max_lines,
+		      int timeout_ms);
+int stream_read_into(lua_State *L, ELI_STREAM *stream, char *buffer,
+		     size_t size, int timeout_ms, size_t *length);
 int stream_read_bytes(lua_State *L, int stream_index, size_t length,
 		      int timeout_ms);
 int stream_write(lua_State *L, ELI_STREAM *stream, const char *data,
 		 size_t size);
+int stream_writev(ELI_STREAM *stream, ELI_STREAM_IOVEC *iov, int iovcnt,
+		  size_t *written);
+int stream_push_write_result(lua_State *L, int status, size_t written);
+int stream_read_frame(lua_State *L, ELI_STREAM *stream,
+		      ELI_STREAM_FRAME_PREFIX prefix, size_t max_size,
+		      int timeout_ms);
+int stream_write_frame(lua_State *L, ELI_STREAM *stream,
+		       ELI_STREAM_FRAME_PREFIX prefix, const char *data,
+		       size_t size);
+int stream_copy(lua_State *L, ELI_STREAM *src, ELI_STREAM *dst, size_t length,
+		int timeout_ms);
+int stream_tee(lua_State *L, ELI_STREAM *src, ELI_STREAM **targets,
+	       int count, size_t length, ELI_STREAM_TEE_POLICY policy,
+	       size_t limit, int timeout_ms);
+long long stream_seek(ELI_STREAM *stream, int whence, long long offset);
+int stream_read_at(lua_State *L, ELI_STREAM *stream, long long offset,
+		   size_t length);
+int stream_write_at(lua_State *L, ELI_STREAM *stream, long long offset,
+		    const char *data, size_t size);
+int stream_flush(ELI_STREAM *stream);
+int stream_drain(ELI_STREAM *stream, int timeout_ms, int *timed_out);
+int stream_sync_filter(ELI_STREAM *stream);
+#ifndef _WIN32
+int stream_enable_map(ELI_STREAM *stream);
+int stream_set_yielding(ELI_STREAM *stream, int yielding);
+int stream_set_readahead(ELI_STREAM *stream, size_t depth);
+int stream_enable_direct(ELI_STREAM *stream);
+#endif
+int stream_preallocate(ELI_STREAM *stream, long long size);
+int stream_set_write_buffering(ELI_STREAM *stream,
+			       ELI_STREAM_BUFFERING buffering, size_t size);
 ELI_STREAM *eli_new_stream(lua_State *L);
 int eli_stream_close(ELI_STREAM *stream);
 #endif
\ No newline at end of file
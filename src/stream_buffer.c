@@ -0,0 +1,98 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "stream_buffer.h"
+
+#define STREAM_BUFFER_MIN_CAPACITY 4096
+// drained buffers larger than this are released instead of kept around
+#define STREAM_BUFFER_MAX_RETAINED_CAPACITY (64 * 1024)
+
+char *stream_buffer_reserve(ELI_STREAM_BUFFER *buffer, size_t size)
+{
+	// the sums below must not wrap
+	if (size > SIZE_MAX - buffer->start - buffer->length) {
+		return NULL;
+	}
+	if (buffer->start + buffer->length + size <= buffer->capacity) {
+		return buffer->data + buffer->start + buffer->length;
+	}
+	// compact only when at least half of the buffer is already consumed
+	// so moving the remaining data is amortized by the consumed bytes
+	if (buffer->length + size <= buffer->capacity &&
+	    buffer->start >= buffer->length) {
+		memmove(buffer->data, buffer->data + buffer->start,
+			buffer->length);
+		buffer->start = 0;
+		return buffer->data + buffer->length;
+	}
+
+	size_t capacity = buffer->capacity < STREAM_BUFFER_MIN_CAPACITY ?
+				  STREAM_BUFFER_MIN_CAPACITY :
+				  buffer->capacity;
+	while (capacity < buffer->length + size) {
+		if (capacity > SIZE_MAX / 2) {
+			capacity = buffer->length + size;
+			break;
+		}
+		capacity *= 2;
+	}
+	char *data = malloc(capacity);
+	if (data == NULL) {
+		return NULL;
+	}
+	if (buffer->length > 0) {
+		memcpy(data, buffer->data + buffer->start, buffer->length);
+	}
+	free(buffer->data);
+	buffer->data = data;
+	buffer->start = 0;
+	buffer->capacity = capacity;
+	return buffer->data + buffer->length;
+}
+
+void stream_buffer_commit(ELI_STREAM_BUFFER *buffer, size_t size)
+{
+	buffer->length += size;
+}
+
+int stream_buffer_append(ELI_STREAM_BUFFER *buffer, const char *data,
+			 size_t size)
+{
+	char *p = stream_buffer_reserve(buffer, size);
+	if (p == NULL) {
+		return 0;
+	}
+	memcpy(p, data, size);
+	buffer->length += size;
+	return 1;
+}
+
+void stream_buffer_truncate(ELI_STREAM_BUFFER *buffer, size_t length)
+{
+	if (length < buffer->length) {
+		buffer->length = length;
+	}
+}
+
+void stream_buffer_consume(ELI_STREAM_BUFFER *buffer, size_t size)
+{
+	if (size >= buffer->length) {
+		buffer->start = 0;
+		buffer->length = 0;
+		if (buffer->capacity > STREAM_BUFFER_MAX_RETAINED_CAPACITY) {
+			stream_buffer_free(buffer);
+		}
+		return;
+	}
+	buffer->start += size;
+	buffer->length -= size;
+}
+
+void stream_buffer_free(ELI_STREAM_BUFFER *buffer)
+{
+	free(buffer->data);
+	buffer->data = NULL;
+	buffer->start = 0;
+	buffer->length = 0;
+	buffer->capacity = 0;
+}
@@ -0,0 +1,30 @@
+#ifndef ELI_STREAM_BUFFER_H__
+#define ELI_STREAM_BUFFER_H__
+
+#include <stddef.h>
+
+// growable byte buffer consumed from the front
+// data lives in data[start, start + length), consuming only moves start
+typedef struct ELI_STREAM_BUFFER {
+	char *data;
+	size_t start;
+	size_t length;
+	size_t capacity;
+} ELI_STREAM_BUFFER;
+
+#define stream_buffer_data(buffer) ((buffer)->data + (buffer)->start)
+#define stream_buffer_length(buffer) ((buffer)->length)
+
+// returns pointer to at least size writable bytes at the end of the buffer
+// or NULL if the allocation failed, data has to be committed to become part
+// of the buffer
+char *stream_buffer_reserve(ELI_STREAM_BUFFER *buffer, size_t size);
+void stream_buffer_commit(ELI_STREAM_BUFFER *buffer, size_t size);
+int stream_buffer_append(ELI_STREAM_BUFFER *buffer, const char *data,
+			 size_t size);
+// drops data past length, undoes appends
+void stream_buffer_truncate(ELI_STREAM_BUFFER *buffer, size_t length);
+void stream_buffer_consume(ELI_STREAM_BUFFER *buffer, size_t size);
+void stream_buffer_free(ELI_STREAM_BUFFER *buffer);
+
+#endif
@@ -0,0 +1,453 @@
+#include "stream_digest.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <nmmintrin.h>
+#define STREAM_CRC32C_X86 1
+#define STREAM_CRC32C_TARGET __attribute__((target("sse4.2")))
+#elif defined(_MSC_VER) && defined(_M_X64)
+#include <intrin.h>
+#include <nmmintrin.h>
+#define STREAM_CRC32C_X86 1
+#define STREAM_CRC32C_TARGET
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define STREAM_CRC32C_ARM 1
+#endif
+
+static uint64_t read_le64(const unsigned char *p)
+{
+	return (uint64_t)p[0] | ((uint64_t)p[1] << 8) | ((uint64_t)p[2] << 16) |
+	       ((uint64_t)p[3] << 24) | ((uint64_t)p[4] << 32) |
+	       ((uint64_t)p[5] << 40) | ((uint64_t)p[6] << 48) |
+	       ((uint64_t)p[7] << 56);
+}
+
+static uint32_t read_le32(const unsigned char *p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) |
+	       ((uint32_t)p[3] << 24);
+}
+
+// crc32c (castagnoli), sliced by 8 bytes when there is no cpu support
+
+static uint32_t crc32c_table[8][256];
+static int crc32c_table_ready;
+
+static void init_crc32c_table(void)
+{
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t crc = i;
+		for (int j = 0; j < 8; j++) {
+			crc = (crc >> 1) ^ (0x82f63b78 & (0 - (crc & 1)));
+		}
+		crc32c_table[0][i] = crc;
+	}
+	for (uint32_t i = 0; i < 256; i++) {
+		for (int j = 1; j < 8; j++) {
+			uint32_t prev = crc32c_table[j - 1][i];
+			crc32c_table[j][i] =
+				(prev >> 8) ^ crc32c_table[0][prev & 0xff];
+		}
+	}
+	crc32c_table_ready = 1;
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t length)
+{
+	while (length >= 8) {
+		uint64_t v = read_le64(p) ^ crc;
+		crc = crc32c_table[7][v & 0xff] ^
+		      crc32c_table[6][(v >> 8) & 0xff] ^
+		      crc32c_table[5][(v >> 16) & 0xff] ^
+		      crc32c_table[4][(v >> 24) & 0xff] ^
+		      crc32c_table[3][(v >> 32) & 0xff] ^
+		      crc32c_table[2][(v >> 40) & 0xff] ^
+		      crc32c_table[1][(v >> 48) & 0xff] ^
+		      crc32c_table[0][v >> 56];
+		p += 8;
+		length -= 8;
+	}
+	while (length-- > 0) {
+		crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xff];
+	}
+	return crc;
+}
+
+#ifdef STREAM_CRC32C_X86
+STREAM_CRC32C_TARGET
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t length)
+{
+	uint64_t crc64 = crc;
+	while (length >= 8) {
+		uint64_t v;
+		memcpy(&v, p, 8);
+		crc64 = _mm_crc32_u64(crc64, v);
+		p += 8;
+		length -= 8;
+	}
+	crc = (uint32_t)crc64;
+	while (length-- > 0) {
+		crc = _mm_crc32_u8(crc, *p++);
+	}
+	return crc;
+}
+
+static int has_crc32c_instructions(void)
+{
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 1);
+	return (info[2] & (1 << 20)) != 0;
+#else
+	return __builtin_cpu_supports("sse4.2") != 0;
+#endif
+}
+#elif defined(STREAM_CRC32C_ARM)
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t length)
+{
+	while (length >= 8) {
+		uint64_t v;
+		memcpy(&v, p, 8);
+		crc = __crc32cd(crc, v);
+		p += 8;
+		length -= 8;
+	}
+	while (length-- > 0) {
+		crc = __crc32cb(crc, *p++);
+	}
+	return crc;
+}
+
+static int has_crc32c_instructions(void)
+{
+	return 1; // the compiler was told the target has them
+}
+#endif
+
+// -1 until detected, racing detections store the same value
+static int crc32c_accelerated = -1;
+
+int stream_digest_crc32c_accelerated(void)
+{
+	if (crc32c_accelerated == -1) {
+#if defined(STREAM_CRC32C_X86) || defined(STREAM_CRC32C_ARM)
+		crc32c_accelerated = has_crc32c_instructions();
+#else
+		crc32c_accelerated = 0;
+#endif
+	}
+	return crc32c_accelerated;
+}
+
+static uint32_t crc32c_update(uint32_t crc, const unsigned char *p,
+			      size_t length)
+{
+#if defined(STREAM_CRC32C_X86) || defined(STREAM_CRC32C_ARM)
+	if (crc32c_accelerated) {
+		return crc32c_hw(crc, p, length);
+	}
+#endif
+	return crc32c_sw(crc, p, length);
+}
+
+// xxh64 with seed 0
+
+#define XXH_PRIME64_1 0x9e3779b185ebca87ULL
+#define XXH_PRIME64_2 0xc2b2ae3d27d4eb4fULL
+#define XXH_PRIME64_3 0x165667b19e3779f9ULL
+#define XXH_PRIME64_4 0x85ebca77c2b2ae63ULL
+#define XXH_PRIME64_5 0x27d4eb2f165667c5ULL
+
+static uint64_t rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+	acc += input * XXH_PRIME64_2;
+	acc = rotl64(acc, 31);
+	return acc * XXH_PRIME64_1;
+}
+
+static uint64_t xxh64_merge_round(uint64_t acc, uint64_t value)
+{
+	acc ^= xxh64_round(0, value);
+	return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+static void xxh64_init(ELI_STREAM_XXH64_STATE *state)
+{
+	memset(state, 0, sizeof(*state));
+	state->v[0] = XXH_PRIME64_1 + XXH_PRIME64_2;
+	state->v[1] = XXH_PRIME64_2;
+	state->v[2] = 0;
+	state->v[3] = 0 - XXH_PRIME64_1;
+}
+
+static void xxh64_stripe(ELI_STREAM_XXH64_STATE *state, const unsigned char *p)
+{
+	for (int i = 0; i < 4; i++) {
+		state->v[i] = xxh64_round(state->v[i], read_le64(p + 8 * i));
+	}
+}
+
+static void xxh64_update(ELI_STREAM_XXH64_STATE *state, const unsigned char *p,
+			 size_t length)
+{
+	state->total_length += length;
+	if (state->buffered > 0) {
+		size_t take = 32 - state->buffered;
+		if (take > length) {
+			take = length;
+		}
+		memcpy(state->buffer + state->buffered, p, take);
+		state->buffered += take;
+		p += take;
+		length -= take;
+		if (state->buffered < 32) {
+			return;
+		}
+		xxh64_stripe(state, state->buffer);
+		state->buffered = 0;
+	}
+	while (length >= 32) {
+		xxh64_stripe(state, p);
+		p += 32;
+		length -= 32;
+	}
+	memcpy(state->buffer, p, length);
+	state->buffered = length;
+}
+
+static uint64_t xxh64_digest(const ELI_STREAM_XXH64_STATE *state)
+{
+	uint64_t h;
+	if (state->total_length >= 32) {
+		h = rotl64(state->v[0], 1) + rotl64(state->v[1], 7) +
+		    rotl64(state->v[2], 12) + rotl64(state->v[3], 18);
+		for (int i = 0; i < 4; i++) {
+			h = xxh64_merge_round(h, state->v[i]);
+		}
+	} else {
+		h = XXH_PRIME64_5;
+	}
+	h += state->total_length;
+
+	const unsigned char *p = state->buffer;
+	size_t length = state->buffered;
+	while (length >= 8) {
+		h ^= xxh64_round(0, read_le64(p));
+		h = rotl64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+		p += 8;
+		length -= 8;
+	}
+	if (length >= 4) {
+		h ^= (uint64_t)read_le32(p) * XXH_PRIME64_1;
+		h = rotl64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+		p += 4;
+		length -= 4;
+	}
+	while (length-- > 0) {
+		h ^= (*p++) * XXH_PRIME64_5;
+		h = rotl64(h, 11) * XXH_PRIME64_1;
+	}
+	h ^= h >> 33;
+	h *= XXH_PRIME64_2;
+	h ^= h >> 29;
+	h *= XXH_PRIME64_3;
+	h ^= h >> 32;
+	return h;
+}
+
+// sha256
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+	0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+	0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+	0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+	0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+	0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static uint32_t rotr32(uint32_t x, int r)
+{
+	return (x >> r) | (x << (32 - r));
+}
+
+static void sha256_init(ELI_STREAM_SHA256_STATE *state)
+{
+	static const uint32_t h[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372,
+				       0xa54ff53a, 0x510e527f, 0x9b05688c,
+				       0x1f83d9ab, 0x5be0cd19 };
+	memset(state, 0, sizeof(*state));
+	memcpy(state->h, h, sizeof(h));
+}
+
+static void sha256_block(uint32_t *h, const unsigned char *p)
+{
+	uint32_t w[64];
+	for (int i = 0; i < 16; i++) {
+		w[i] = ((uint32_t)p[4 * i] << 24) |
+		       ((uint32_t)p[4 * i + 1] << 16) |
+		       ((uint32_t)p[4 * i + 2] << 8) | p[4 * i + 3];
+	}
+	for (int i = 16; i < 64; i++) {
+		uint32_t s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^
+			      (w[i - 15] >> 3);
+		uint32_t s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^
+			      (w[i - 2] >> 10);
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+	uint32_t a = h[0], b = h[1], c = h[2], d = h[3];
+	uint32_t e = h[4], f = h[5], g = h[6], k = h[7];
+	for (int i = 0; i < 64; i++) {
+		uint32_t s1 = rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25);
+		uint32_t ch = (e & f) ^ (~e & g);
+		uint32_t t1 = k + s1 + ch + sha256_k[i] + w[i];
+		uint32_t s0 = rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22);
+		uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+		uint32_t t2 = s0 + maj;
+		k = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+	h[0] += a;
+	h[1] += b;
+	h[2] += c;
+	h[3] += d;
+	h[4] += e;
+	h[5] += f;
+	h[6] += g;
+	h[7] += k;
+}
+
+static void sha256_update(ELI_STREAM_SHA256_STATE *state,
+			  const unsigned char *p, size_t length)
+{
+	state->total_length += length;
+	if (state->buffered > 0) {
+		size_t take = 64 - state->buffered;
+		if (take > length) {
+			take = length;
+		}
+		memcpy(state->buffer + state->buffered, p, take);
+		state->buffered += take;
+		p += take;
+		length -= take;
+		if (state->buffered < 64) {
+			return;
+		}
+		sha256_block(state->h, state->buffer);
+		state->buffered = 0;
+	}
+	while (length >= 64) {
+		sha256_block(state->h, p);
+		p += 64;
+		length -= 64;
+	}
+	memcpy(state->buffer, p, length);
+	state->buffered = length;
+}
+
+static void sha256_digest(const ELI_STREAM_SHA256_STATE *state,
+			  unsigned char *out)
+{
+	// padding goes to a copy, the stream may keep hashing afterwards
+	ELI_STREAM_SHA256_STATE final = *state;
+	uint64_t bits = state->total_length * 8;
+	unsigned char padding[72] = { 0x80 };
+	size_t padding_length = (final.buffered < 56 ? 56 : 120) -
+				final.buffered;
+	for (int i = 0; i < 8; i++) {
+		padding[padding_length + i] = (unsigned char)(bits >> (56 - 8 * i));
+	}
+	sha256_update(&final, padding, padding_length + 8);
+	for (int i = 0; i < 8; i++) {
+		out[4 * i] = (unsigned char)(final.h[i] >> 24);
+		out[4 * i + 1] = (unsigned char)(final.h[i] >> 16);
+		out[4 * i + 2] = (unsigned char)(final.h[i] >> 8);
+		out[4 * i + 3] = (unsigned char)final.h[i];
+	}
+}
+
+void stream_digest_init(struct ELI_STREAM_DIGEST *digest,
+			ELI_STREAM_DIGEST_ALGO algo)
+{
+	digest->algo = algo;
+	switch (algo) {
+	case ELI_STREAM_DIGEST_CRC32C:
+		if (!crc32c_table_ready) {
+			init_crc32c_table();
+		}
+		stream_digest_crc32c_accelerated();
+		digest->state.crc32c = 0xffffffff;
+		break;
+	case ELI_STREAM_DIGEST_XXH64:
+		xxh64_init(&digest->state.xxh64);
+		break;
+	case ELI_STREAM_DIGEST_SHA256:
+		sha256_init(&digest->state.sha256);
+		break;
+	case ELI_STREAM_DIGEST_NONE:
+		break;
+	}
+}
+
+void stream_digest_update(struct ELI_STREAM_DIGEST *digest, const void *data,
+			  size_t length)
+{
+	switch (digest->algo) {
+	case ELI_STREAM_DIGEST_CRC32C:
+		digest->state.crc32c =
+			crc32c_update(digest->state.crc32c, data, length);
+		break;
+	case ELI_STREAM_DIGEST_XXH64:
+		xxh64_update(&digest->state.xxh64, data, length);
+		break;
+	case ELI_STREAM_DIGEST_SHA256:
+		sha256_update(&digest->state.sha256, data, length);
+		break;
+	case ELI_STREAM_DIGEST_NONE:
+		break;
+	}
+}
+
+void stream_digest_hex(const struct ELI_STREAM_DIGEST *digest, char *hex)
+{
+	switch (digest->algo) {
+	case ELI_STREAM_DIGEST_CRC32C:
+		snprintf(hex, ELI_STREAM_DIGEST_MAX_HEX_SIZE, "%08lx",
+			 (unsigned long)(digest->state.crc32c ^ 0xffffffff));
+		break;
+	case ELI_STREAM_DIGEST_XXH64:
+		snprintf(hex, ELI_STREAM_DIGEST_MAX_HEX_SIZE, "%016llx",
+			 (unsigned long long)xxh64_digest(&digest->state.xxh64));
+		break;
+	case ELI_STREAM_DIGEST_SHA256: {
+		unsigned char out[32];
+		sha256_digest(&digest->state.sha256, out);
+		for (int i = 0; i < 32; i++) {
+			snprintf(hex + 2 * i, 3, "%02x", out[i]);
+		}
+		break;
+	}
+	case ELI_STREAM_DIGEST_NONE:
+		*hex = '\0';
+		break;
+	}
+}
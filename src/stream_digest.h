@@ -0,0 +1,51 @@
+#ifndef ELI_STREAM_DIGEST_H__
+#define ELI_STREAM_DIGEST_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum ELI_STREAM_DIGEST_ALGO {
+	ELI_STREAM_DIGEST_NONE, // zeroed digests are disabled
+	ELI_STREAM_DIGEST_CRC32C,
+	ELI_STREAM_DIGEST_XXH64,
+	ELI_STREAM_DIGEST_SHA256
+} ELI_STREAM_DIGEST_ALGO;
+
+// longest digest (sha256) as lowercase hex with the terminating zero
+#define ELI_STREAM_DIGEST_MAX_HEX_SIZE 65
+
+typedef struct ELI_STREAM_XXH64_STATE {
+	uint64_t total_length;
+	uint64_t v[4];
+	unsigned char buffer[32];
+	size_t buffered;
+} ELI_STREAM_XXH64_STATE;
+
+typedef struct ELI_STREAM_SHA256_STATE {
+	uint64_t total_length;
+	uint32_t h[8];
+	unsigned char buffer[64];
+	size_t buffered;
+} ELI_STREAM_SHA256_STATE;
+
+// running digest of the data passing through a stream
+struct ELI_STREAM_DIGEST {
+	ELI_STREAM_DIGEST_ALGO algo;
+	union {
+		uint32_t crc32c;
+		ELI_STREAM_XXH64_STATE xxh64;
+		ELI_STREAM_SHA256_STATE sha256;
+	} state;
+};
+
+void stream_digest_init(struct ELI_STREAM_DIGEST *digest,
+			ELI_STREAM_DIGEST_ALGO algo);
+void stream_digest_update(struct ELI_STREAM_DIGEST *digest, const void *data,
+			  size_t length);
+// writes the digest of the data so far as lowercase hex into hex, the
+// running state is not changed so the digest can be taken repeatedly
+void stream_digest_hex(const struct ELI_STREAM_DIGEST *digest, char *hex);
+// 1 if crc32c is computed with cpu instructions
+int stream_digest_crc32c_accelerated(void);
+
+#endif
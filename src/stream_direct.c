@@ -0,0 +1,208 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include "stream_direct.h"
+
+#ifdef ELI_STREAM_DIRECT_SUPPORTED
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static int set_direct_flag(int fd, int enabled)
+{
+#ifdef O_DIRECT
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags == -1) {
+		return 0;
+	}
+	flags = enabled ? flags | O_DIRECT : flags & ~O_DIRECT;
+	return fcntl(fd, F_SETFL, flags) != -1;
+#elif defined(F_NOCACHE)
+	return fcntl(fd, F_NOCACHE, enabled) != -1;
+#else
+	(void)fd;
+	if (enabled) {
+		errno = ENOTSUP;
+		return 0;
+	}
+	return 1;
+#endif
+}
+
+ELI_STREAM_DIRECT *stream_direct_new(int fd)
+{
+	ELI_STREAM_DIRECT *direct = calloc(1, sizeof(ELI_STREAM_DIRECT));
+	if (direct == NULL) {
+		return NULL;
+	}
+	void *buffer;
+	int res = posix_memalign(&buffer, ELI_STREAM_DIRECT_ALIGNMENT,
+				 ELI_STREAM_DIRECT_BUFFER_SIZE);
+	if (res != 0) {
+		free(direct);
+		errno = res;
+		return NULL;
+	}
+	direct->buffer = buffer;
+	direct->fd = fd;
+	direct->position = lseek(fd, 0, SEEK_CUR);
+	if (direct->position == -1 || !set_direct_flag(fd, 1)) {
+		int error = errno;
+		free(direct->buffer);
+		free(direct);
+		errno = error;
+		return NULL;
+	}
+	return direct;
+}
+
+void stream_direct_free(ELI_STREAM_DIRECT *direct)
+{
+	set_direct_flag(direct->fd, 0);
+	lseek(direct->fd, direct->position, SEEK_SET);
+	free(direct->buffer);
+	free(direct);
+}
+
+off_t stream_direct_seek(ELI_STREAM_DIRECT *direct, off_t offset, int whence)
+{
+	off_t base;
+	switch (whence) {
+	case SEEK_SET:
+		base = 0;
+		break;
+	case SEEK_CUR:
+		base = direct->position;
+		break;
+	case SEEK_END: {
+		struct stat st;
+		if (fstat(direct->fd, &st) == -1) {
+			return -1;
+		}
+		base = st.st_size;
+		break;
+	}
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+	if (base + offset < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	direct->position = base + offset;
+	return direct->position;
+}
+
+ssize_t stream_direct_pread(ELI_STREAM_DIRECT *direct, void *buffer,
+			    size_t size, off_t offset)
+{
+	if (direct->length == 0 || offset < direct->offset ||
+	    offset >= direct->offset + (off_t)direct->length) {
+		off_t aligned = offset - offset % ELI_STREAM_DIRECT_ALIGNMENT;
+		ssize_t res;
+		do {
+			res = pread(direct->fd, direct->buffer,
+				    ELI_STREAM_DIRECT_BUFFER_SIZE, aligned);
+		} while (res == -1 && errno == EINTR);
+		if (res == -1) {
+			direct->length = 0;
+			return -1;
+		}
+		direct->offset = aligned;
+		direct->length = (size_t)res;
+		if (offset >= aligned + res) {
+			return 0; // EOF
+		}
+	}
+	size_t skip = (size_t)(offset - direct->offset);
+	size_t available = direct->length - skip;
+	if (size > available) {
+		size = available;
+	}
+	memcpy(buffer, direct->buffer + skip, size);
+	return (ssize_t)size;
+}
+
+// the kernel rejects unaligned O_DIRECT writes, so data within a single
+// block is merged into it, a block written past the end of the file is
+// cut back to where the file or the data ends
+static ssize_t pwrite_block(ELI_STREAM_DIRECT *direct, const char *data,
+			    size_t size, off_t offset)
+{
+	off_t block = offset - offset % ELI_STREAM_DIRECT_ALIGNMENT;
+	ssize_t res;
+	do {
+		res = pread(direct->fd, direct->buffer,
+			    ELI_STREAM_DIRECT_ALIGNMENT, block);
+	} while (res == -1 && errno == EINTR);
+	if (res == -1) {
+		return -1;
+	}
+	off_t end = block + res; // short reads end at EOF
+	memset(direct->buffer + res, 0, ELI_STREAM_DIRECT_ALIGNMENT - res);
+	memcpy(direct->buffer + (offset - block), data, size);
+	do {
+		res = pwrite(direct->fd, direct->buffer,
+			     ELI_STREAM_DIRECT_ALIGNMENT, block);
+	} while (res == -1 && errno == EINTR);
+	if (res != ELI_STREAM_DIRECT_ALIGNMENT) {
+		if (res >= 0) {
+			errno = EIO;
+		}
+		return -1;
+	}
+	if (offset + (off_t)size > end) {
+		end = offset + (off_t)size;
+	}
+	if (end < block + ELI_STREAM_DIRECT_ALIGNMENT &&
+	    ftruncate(direct->fd, end) == -1) {
+		return -1;
+	}
+	return (ssize_t)size;
+}
+
+ssize_t stream_direct_pwrite(ELI_STREAM_DIRECT *direct, const void *data,
+			     size_t size, off_t offset)
+{
+	direct->length = 0; // the cached blocks may be overwritten
+	const char *p = (const char *)data;
+	size_t total = 0;
+	while (total < size) {
+		off_t at = offset + (off_t)total;
+		size_t left = size - total;
+		size_t misalignment = (size_t)(at % ELI_STREAM_DIRECT_ALIGNMENT);
+		ssize_t res;
+		if (misalignment == 0 && left >= ELI_STREAM_DIRECT_ALIGNMENT) {
+			size_t chunk = left - left % ELI_STREAM_DIRECT_ALIGNMENT;
+			if (chunk > ELI_STREAM_DIRECT_BUFFER_SIZE) {
+				chunk = ELI_STREAM_DIRECT_BUFFER_SIZE;
+			}
+			memcpy(direct->buffer, p + total, chunk);
+			res = pwrite(direct->fd, direct->buffer, chunk, at);
+		} else {
+			// up to the next block boundary, or the whole tail
+			size_t chunk = misalignment == 0 ?
+					       left :
+					       ELI_STREAM_DIRECT_ALIGNMENT -
+						       misalignment;
+			if (chunk > left) {
+				chunk = left;
+			}
+			res = pwrite_block(direct, p + total, chunk, at);
+		}
+		if (res == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return total > 0 ? (ssize_t)total : -1;
+		}
+		total += (size_t)res;
+	}
+	return (ssize_t)total;
+}
+#endif
@@ -0,0 +1,44 @@
+#ifndef ELI_STREAM_DIRECT_H__
+#define ELI_STREAM_DIRECT_H__
+
+#ifndef _WIN32
+#define ELI_STREAM_DIRECT_SUPPORTED 1
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// O_DIRECT transfers need the memory, offset and size aligned to the logical
+// block size of the device, 4096 covers all common devices
+#define ELI_STREAM_DIRECT_ALIGNMENT 4096
+// reads fetch and writes pass at most this much per syscall
+#define ELI_STREAM_DIRECT_BUFFER_SIZE (1024 * 1024)
+
+// aligned staging buffer of an uncached file, it also keeps the blocks read
+// last so reads smaller than a block do not go to the device each time
+typedef struct ELI_STREAM_DIRECT {
+	int fd;
+	char *buffer;
+	off_t offset; // file offset of the cached blocks
+	size_t length; // cached bytes, 0 if nothing is cached
+	// where the stream reads and writes next, the fd offset is left alone
+	// until the file is switched back
+	off_t position;
+} ELI_STREAM_DIRECT;
+
+// switches fd to uncached I/O (O_DIRECT, F_NOCACHE on macOS)
+// returns NULL with errno set on failure, EINVAL if the filesystem refuses
+ELI_STREAM_DIRECT *stream_direct_new(int fd);
+// switches fd back to cached I/O at the position and frees direct
+void stream_direct_free(ELI_STREAM_DIRECT *direct);
+// lseek(2) of the position
+off_t stream_direct_seek(ELI_STREAM_DIRECT *direct, off_t offset, int whence);
+// pread(2) for any buffer, offset and size
+ssize_t stream_direct_pread(ELI_STREAM_DIRECT *direct, void *buffer,
+			    size_t size, off_t offset);
+// pwrite(2) for any data, offset and size, an unaligned head or tail is
+// merged into its block which is read and written back whole
+ssize_t stream_direct_pwrite(ELI_STREAM_DIRECT *direct, const void *data,
+			     size_t size, off_t offset);
+#endif
+
+#endif
@@ -0,0 +1,143 @@
+#include "stream_readahead.h"
+
+#ifdef ELI_STREAM_READAHEAD_SUPPORTED
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static void *readahead_worker(void *arg)
+{
+	ELI_STREAM_READAHEAD *readahead = (ELI_STREAM_READAHEAD *)arg;
+	pthread_mutex_lock(&readahead->mutex);
+	while (!readahead->stop) {
+		size_t free_space = readahead->capacity - readahead->length;
+		if (free_space < readahead->chunk_size) {
+			pthread_cond_wait(&readahead->not_full, &readahead->mutex);
+			continue;
+		}
+		size_t tail = (readahead->head + readahead->length) %
+			      readahead->capacity;
+		size_t size = readahead->capacity - tail;
+		if (size > readahead->chunk_size) {
+			size = readahead->chunk_size;
+		}
+		// the consumer only touches [head, head + length), the free
+		// part is ours while unlocked
+		pthread_mutex_unlock(&readahead->mutex);
+		ssize_t res = read(readahead->fd, readahead->ring + tail, size);
+		int error = errno;
+		pthread_mutex_lock(&readahead->mutex);
+		if (res > 0) {
+			readahead->length += (size_t)res;
+		} else if (res == 0) {
+			readahead->eof = 1;
+		} else if (error != EINTR) {
+			readahead->error = error;
+		}
+		pthread_cond_signal(&readahead->not_empty);
+		if (readahead->eof || readahead->error) {
+			break;
+		}
+	}
+	pthread_mutex_unlock(&readahead->mutex);
+	return NULL;
+}
+
+ELI_STREAM_READAHEAD *stream_readahead_start(int fd, size_t depth)
+{
+	ELI_STREAM_READAHEAD *readahead = calloc(1, sizeof(ELI_STREAM_READAHEAD));
+	if (readahead == NULL) {
+		return NULL;
+	}
+	if (depth < ELI_STREAM_READAHEAD_MIN_DEPTH) {
+		depth = ELI_STREAM_READAHEAD_MIN_DEPTH;
+	}
+	readahead->chunk_size = depth / 4 < ELI_STREAM_READAHEAD_MAX_CHUNK_SIZE ?
+					depth / 4 :
+					ELI_STREAM_READAHEAD_MAX_CHUNK_SIZE;
+	// whole chunks keep the background reads aligned to the ring
+	readahead->capacity = depth - depth % readahead->chunk_size;
+	readahead->fd = fd;
+	readahead->ring = malloc(readahead->capacity);
+	if (readahead->ring == NULL) {
+		free(readahead);
+		errno = ENOMEM;
+		return NULL;
+	}
+	pthread_mutex_init(&readahead->mutex, NULL);
+	pthread_cond_init(&readahead->not_empty, NULL);
+	pthread_cond_init(&readahead->not_full, NULL);
+	int res = pthread_create(&readahead->thread, NULL, readahead_worker,
+				 readahead);
+	if (res != 0) {
+		pthread_cond_destroy(&readahead->not_full);
+		pthread_cond_destroy(&readahead->not_empty);
+		pthread_mutex_destroy(&readahead->mutex);
+		free(readahead->ring);
+		free(readahead);
+		errno = res;
+		return NULL;
+	}
+	return readahead;
+}
+
+int stream_readahead_stop(ELI_STREAM_READAHEAD *readahead)
+{
+	pthread_mutex_lock(&readahead->mutex);
+	readahead->stop = 1;
+	pthread_cond_signal(&readahead->not_full);
+	pthread_mutex_unlock(&readahead->mutex);
+	// a read in progress is finished first, it is at most one chunk
+	pthread_join(readahead->thread, NULL);
+
+	int ok = readahead->length == 0 ||
+		 lseek(readahead->fd, -(off_t)readahead->length, SEEK_CUR) !=
+			 -1;
+	pthread_cond_destroy(&readahead->not_full);
+	pthread_cond_destroy(&readahead->not_empty);
+	pthread_mutex_destroy(&readahead->mutex);
+	free(readahead->ring);
+	free(readahead);
+	return ok;
+}
+
+int stream_readahead_read(ELI_STREAM_READAHEAD *readahead, char *buffer,
+			  size_t size)
+{
+	pthread_mutex_lock(&readahead->mutex);
+	while (readahead->length == 0 && !readahead->eof &&
+	       !readahead->error) {
+		pthread_cond_wait(&readahead->not_empty, &readahead->mutex);
+	}
+	if (readahead->length == 0) {
+		int error = readahead->error;
+		pthread_mutex_unlock(&readahead->mutex);
+		if (error != 0) {
+			errno = error;
+			return -1;
+		}
+		return 0;
+	}
+	size_t length = readahead->length;
+	if (length > readahead->capacity - readahead->head) {
+		length = readahead->capacity - readahead->head;
+	}
+	if (length > size) {
+		length = size;
+	}
+	if (length > INT_MAX) {
+		length = INT_MAX;
+	}
+	pthread_mutex_unlock(&readahead->mutex);
+	// the worker never writes to unconsumed data
+	memcpy(buffer, readahead->ring + readahead->head, length);
+	pthread_mutex_lock(&readahead->mutex);
+	readahead->head = (readahead->head + length) % readahead->capacity;
+	readahead->length -= length;
+	pthread_cond_signal(&readahead->not_full);
+	pthread_mutex_unlock(&readahead->mutex);
+	return (int)length;
+}
+#endif
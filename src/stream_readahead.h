@@ -0,0 +1,45 @@
+#ifndef ELI_STREAM_READAHEAD_H__
+#define ELI_STREAM_READAHEAD_H__
+
+#ifndef _WIN32
+#define ELI_STREAM_READAHEAD_SUPPORTED 1
+
+#include <pthread.h>
+#include <stddef.h>
+
+// smallest readahead depth, also the most a single background read asks for
+// is a quarter of the depth capped at ELI_STREAM_READAHEAD_MAX_CHUNK_SIZE
+#define ELI_STREAM_READAHEAD_MIN_DEPTH (64 * 1024)
+#define ELI_STREAM_READAHEAD_MAX_CHUNK_SIZE (1024 * 1024)
+
+// background thread reading a file ahead into a ring buffer, the stream
+// consumes from the ring instead of the fd
+typedef struct ELI_STREAM_READAHEAD {
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	int fd;
+	char *ring;
+	size_t capacity;
+	size_t chunk_size;
+	size_t head; // first unconsumed byte
+	size_t length; // unconsumed bytes
+	int eof;
+	int error; // errno of the failed read, 0 if none
+	int stop;
+} ELI_STREAM_READAHEAD;
+
+// starts reading fd from its current offset with up to depth bytes ahead
+// returns NULL with errno set on failure
+ELI_STREAM_READAHEAD *stream_readahead_start(int fd, size_t depth);
+// joins the thread and moves the fd offset back to the first unconsumed
+// byte, returns 0 if the offset could not be restored, frees readahead
+int stream_readahead_stop(ELI_STREAM_READAHEAD *readahead);
+// copies up to size prefetched bytes, waits only while nothing is prefetched
+// returns number of bytes, 0 on EOF and -1 with errno set on error
+int stream_readahead_read(ELI_STREAM_READAHEAD *readahead, char *buffer,
+			  size_t size);
+#endif
+
+#endif
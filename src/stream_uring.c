@@ -0,0 +1,203 @@
+#include "stream_uring.h"
+
+#ifdef ELI_STREAM_URING_SUPPORTED
+#include <errno.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/fs.h>
+#include "stream_buffer.h"
+
+static int uring_setup(unsigned entries, struct io_uring_params *params)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+		       unsigned flags)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+			    flags, NULL, 0);
+}
+
+int stream_uring_init(ELI_STREAM_URING *ring, unsigned entries)
+{
+	struct io_uring_params params;
+	memset(ring, 0, sizeof(ELI_STREAM_URING));
+	memset(&params, 0, sizeof(params));
+	ring->fd = uring_setup(entries, &params);
+	if (ring->fd == -1) {
+		return 0;
+	}
+	ring->entries = params.sq_entries;
+
+	ring->sq_ring_size =
+		params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = params.cq_off.cqes +
+			     params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size) {
+			ring->sq_ring_size = ring->cq_ring_size;
+		}
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, ring->fd,
+			     IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED) {
+		ring->sq_ring = NULL;
+		stream_uring_close(ring);
+		return 0;
+	}
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size,
+				     PROT_READ | PROT_WRITE,
+				     MAP_SHARED | MAP_POPULATE, ring->fd,
+				     IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED) {
+			ring->cq_ring = NULL;
+			stream_uring_close(ring);
+			return 0;
+		}
+	}
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring->fd,
+			  IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		stream_uring_close(ring);
+		return 0;
+	}
+
+	char *sq = ring->sq_ring;
+	ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+	ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+	ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+	char *cq = ring->cq_ring;
+	ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+	ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+	ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+	return 1;
+}
+
+void stream_uring_close(ELI_STREAM_URING *ring)
+{
+	if (ring->sqes != NULL) {
+		munmap(ring->sqes, ring->sqes_size);
+	}
+	if (ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring) {
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	}
+	if (ring->sq_ring != NULL) {
+		munmap(ring->sq_ring, ring->sq_ring_size);
+	}
+	if (ring->fd != -1) {
+		close(ring->fd);
+	}
+	memset(ring, 0, sizeof(ELI_STREAM_URING));
+	ring->fd = -1;
+}
+
+// submits one batch of reads, count has to fit into the ring
+static int fill_batch(ELI_STREAM_URING *ring, ELI_STREAM **streams,
+		      int count, size_t size)
+{
+	unsigned tail = *ring->sq_tail;
+	int submitted = 0;
+	for (int i = 0; i < count; i++) {
+		char *p = stream_buffer_reserve(&streams[i]->pending, size);
+		if (p == NULL) {
+			continue;
+		}
+		unsigned index = tail & *ring->sq_mask;
+		struct io_uring_sqe *sqe = &ring->sqes[index];
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = IORING_OP_READ;
+		sqe->fd = streams[i]->fd;
+		sqe->addr = (unsigned long)p;
+		sqe->len = (unsigned)size;
+		sqe->off = (__u64)-1; // use and advance the file position
+		// never park the ring on a stream somebody else drained
+		sqe->rw_flags = RWF_NOWAIT;
+		sqe->user_data = (__u64)i;
+		ring->sq_array[index] = index;
+		tail++;
+		submitted++;
+	}
+	if (submitted == 0) {
+		return 0;
+	}
+	atomic_store_explicit((_Atomic unsigned *)ring->sq_tail, tail,
+			      memory_order_release);
+
+	int res;
+	do {
+		res = uring_enter(ring->fd, submitted, submitted,
+				  IORING_ENTER_GETEVENTS);
+	} while (res == -1 && errno == EINTR);
+	if (res == -1) {
+		return -1;
+	}
+
+	int filled = 0;
+	int completed = 0;
+	unsigned head = *ring->cq_head;
+	while (completed < submitted) {
+		unsigned cq_tail = atomic_load_explicit(
+			(_Atomic unsigned *)ring->cq_tail,
+			memory_order_acquire);
+		if (head == cq_tail) {
+			// the kernel did not post everything yet
+			do {
+				res = uring_enter(ring->fd, 0, 1,
+						  IORING_ENTER_GETEVENTS);
+			} while (res == -1 && errno == EINTR);
+			if (res == -1) {
+				break;
+			}
+			continue;
+		}
+		struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+		// failed reads are left to the next regular read to report
+		ELI_STREAM *stream = streams[cqe->user_data];
+		if (cqe->res < 0) {
+			errno = -cqe->res;
+		}
+		stream_count_read(stream, cqe->res < 0 ? -1 : cqe->res);
+		if (cqe->res > 0) {
+			stream_buffer_commit(&stream->pending, cqe->res);
+			stream_note_pending(stream);
+			filled++;
+		}
+		head++;
+		completed++;
+	}
+	atomic_store_explicit((_Atomic unsigned *)ring->cq_head, head,
+			      memory_order_release);
+	return filled;
+}
+
+int stream_uring_fill(ELI_STREAM_URING *ring, ELI_STREAM **streams,
+		      int count, size_t size)
+{
+	int filled = 0;
+	for (int offset = 0; offset < count; offset += ring->entries) {
+		int batch = count - offset < (int)ring->entries ?
+				    count - offset :
+				    (int)ring->entries;
+		int res = fill_batch(ring, streams + offset, batch, size);
+		if (res == -1) {
+			return -1;
+		}
+		filled += res;
+	}
+	return filled;
+}
+#endif
@@ -0,0 +1,39 @@
+#ifndef ELI_STREAM_URING_H__
+#define ELI_STREAM_URING_H__
+
+#if defined(__linux__) && defined(ELI_STREAM_EXTRA_IO_URING)
+#define ELI_STREAM_URING_SUPPORTED 1
+
+#include <linux/io_uring.h>
+#include "stream.h"
+
+// minimal io_uring used to batch reads of many streams into one syscall
+typedef struct ELI_STREAM_URING {
+	int fd;
+	unsigned entries;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+} ELI_STREAM_URING;
+
+// returns 0 if io_uring is not available (old kernel, seccomp, ...)
+int stream_uring_init(ELI_STREAM_URING *ring, unsigned entries);
+void stream_uring_close(ELI_STREAM_URING *ring);
+// reads up to size bytes into the pending buffer of each stream
+// returns number of streams which received data or -1 on failure
+int stream_uring_fill(ELI_STREAM_URING *ring, ELI_STREAM **streams,
+		      int count, size_t size);
+#endif
+
+#endif
@@ -194,4 +194,94 @@ int stream_win_write(ELI_STREAM *stream, const char *data, size_t size)
 	return bytesWritten;
 }
 
+static void set_overlapped_offset(OVERLAPPED *overlapped, long long offset)
+{
+	overlapped->Offset = (DWORD)offset;
+	overlapped->OffsetHigh = (DWORD)((ULONGLONG)offset >> 32);
+}
+
+// positional reads and writes wait for overlapped handles to complete
+int stream_win_read_at(ELI_STREAM *stream, char *buffer, size_t size,
+		       long long offset)
+{
+	OVERLAPPED overlapped = { 0 };
+	set_overlapped_offset(&overlapped, offset);
+	DWORD bytes_read = 0;
+	if (!ReadFile(stream->fd, buffer, (DWORD)size, &bytes_read,
+		      &overlapped)) {
+		if (GetLastError() == ERROR_IO_PENDING &&
+		    GetOverlappedResult(stream->fd, &overlapped, &bytes_read,
+					TRUE)) {
+			return bytes_read;
+		}
+		return GetLastError() == ERROR_HANDLE_EOF ? 0 : -1;
+	}
+	return bytes_read;
+}
+
+int stream_win_write_at(ELI_STREAM *stream, const char *data, size_t size,
+			long long offset)
+{
+	OVERLAPPED overlapped = { 0 };
+	set_overlapped_offset(&overlapped, offset);
+	DWORD bytes_written = 0;
+	if (!WriteFile(stream->fd, data, (DWORD)size, &bytes_written,
+		       &overlapped)) {
+		if (GetLastError() != ERROR_IO_PENDING ||
+		    !GetOverlappedResult(stream->fd, &overlapped,
+					 &bytes_written, TRUE)) {
+			return -1;
+		}
+	}
+	return bytes_written;
+}
+
+// overlapped handles keep their position in stream->overlapped
+long long stream_win_seek(ELI_STREAM *stream, long long offset, int whence)
+{
+	if (!stream->use_overlapped) {
+		LARGE_INTEGER distance, position;
+		distance.QuadPart = offset;
+		DWORD method = whence == SEEK_SET ? FILE_BEGIN :
+			       whence == SEEK_END ? FILE_END :
+						    FILE_CURRENT;
+		if (!SetFilePointerEx(stream->fd, distance, &position,
+				      method)) {
+			return -1;
+		}
+		return position.QuadPart;
+	}
+
+	if (stream->overlapped_pending) {
+		// the read in flight belongs to the old position
+		DWORD ignored;
+		CancelIo(stream->fd);
+		GetOverlappedResult(stream->fd, &stream->overlapped, &ignored,
+				    TRUE);
+		stream->overlapped_pending = 0;
+	}
+	long long base = 0;
+	switch (whence) {
+	case SEEK_CUR:
+		base = (long long)(((ULONGLONG)stream->overlapped.OffsetHigh
+				    << 32) |
+				   stream->overlapped.Offset);
+		break;
+	case SEEK_END: {
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(stream->fd, &size)) {
+			return -1;
+		}
+		base = size.QuadPart;
+		break;
+	}
+	}
+	if (base + offset < 0) {
+		SetLastError(ERROR_NEGATIVE_SEEK);
+		return -1;
+	}
+	set_overlapped_offset(&stream->overlapped, base + offset);
+	return base + offset;
+}
+
 #endif
\ No newline at end of file
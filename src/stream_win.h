@@ -7,6 +7,11 @@
 
 int stream_win_read(ELI_STREAM *stream, char *buffer, size_t size);
 int stream_win_write(ELI_STREAM *stream, const char *data, size_t size);
+int stream_win_read_at(ELI_STREAM *stream, char *buffer, size_t size,
+		       long long offset);
+int stream_win_write_at(ELI_STREAM *stream, const char *data, size_t size,
+			long long offset);
+long long stream_win_seek(ELI_STREAM *stream, long long offset, int whence);
 
 #endif
 #endif // ELI_STREAM_WIN_EXTRA_H__
\ No newline at end of file
@@ -0,0 +1,92 @@
+#include "stream_zlib.h"
+
+#ifdef ELI_STREAM_ZLIB_SUPPORTED
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int get_window_bits(ELI_STREAM_ZLIB_FORMAT format)
+{
+	switch (format) {
+	case ELI_STREAM_ZLIB_RAW:
+		return -MAX_WBITS;
+	case ELI_STREAM_ZLIB_ZLIB:
+		return MAX_WBITS;
+	case ELI_STREAM_ZLIB_GZIP:
+		return MAX_WBITS + 16;
+	case ELI_STREAM_ZLIB_AUTO:
+	default:
+		return MAX_WBITS + 32;
+	}
+}
+
+struct ELI_STREAM_FILTER *stream_filter_new(int deflating,
+					    ELI_STREAM_ZLIB_FORMAT format,
+					    int level)
+{
+	struct ELI_STREAM_FILTER *filter =
+		calloc(1, sizeof(struct ELI_STREAM_FILTER));
+	if (filter == NULL) {
+		return NULL;
+	}
+	filter->deflating = deflating;
+	int res = deflating ? deflateInit2(&filter->z, level, Z_DEFLATED,
+					   get_window_bits(format), 8,
+					   Z_DEFAULT_STRATEGY) :
+			      inflateInit2(&filter->z, get_window_bits(format));
+	if (res != Z_OK) {
+		free(filter);
+		return NULL;
+	}
+	return filter;
+}
+
+void stream_filter_free(struct ELI_STREAM_FILTER *filter)
+{
+	if (filter == NULL) {
+		return;
+	}
+	if (filter->deflating) {
+		deflateEnd(&filter->z);
+	} else {
+		inflateEnd(&filter->z);
+	}
+	free(filter);
+}
+
+int stream_filter_process(struct ELI_STREAM_FILTER *filter, const char *input,
+			  size_t input_length, size_t *consumed, char *output,
+			  size_t output_size, size_t *produced,
+			  ELI_STREAM_FILTER_FLUSH flush)
+{
+	z_stream *z = &filter->z;
+	// zlib counts in uInt, the caller loops for the rest
+	uInt in = input_length > UINT_MAX ? UINT_MAX : (uInt)input_length;
+	uInt out = output_size > UINT_MAX ? UINT_MAX : (uInt)output_size;
+	z->next_in = (Bytef *)input;
+	z->avail_in = in;
+	z->next_out = (Bytef *)output;
+	z->avail_out = out;
+	int res;
+	if (filter->deflating) {
+		res = deflate(z, flush == ELI_STREAM_FILTER_FINISH ? Z_FINISH :
+				 flush == ELI_STREAM_FILTER_SYNC_FLUSH ?
+								     Z_SYNC_FLUSH :
+								     Z_NO_FLUSH);
+	} else {
+		res = inflate(z, Z_NO_FLUSH);
+	}
+	*consumed = in - z->avail_in;
+	*produced = out - z->avail_out;
+	switch (res) {
+	case Z_STREAM_END:
+		filter->finished = 1;
+		return 0;
+	case Z_OK:
+	case Z_BUF_ERROR: // no progress possible without more input/output
+		return 1;
+	default:
+		return -1;
+	}
+}
+#endif
@@ -0,0 +1,44 @@
+#ifndef ELI_STREAM_ZLIB_H__
+#define ELI_STREAM_ZLIB_H__
+
+#ifdef ELI_STREAM_EXTRA_ZLIB
+#define ELI_STREAM_ZLIB_SUPPORTED 1
+
+#include <stddef.h>
+#include <zlib.h>
+
+typedef enum ELI_STREAM_ZLIB_FORMAT {
+	ELI_STREAM_ZLIB_RAW,
+	ELI_STREAM_ZLIB_ZLIB,
+	ELI_STREAM_ZLIB_GZIP,
+	ELI_STREAM_ZLIB_AUTO // gzip or zlib, decompression only
+} ELI_STREAM_ZLIB_FORMAT;
+
+typedef enum ELI_STREAM_FILTER_FLUSH {
+	ELI_STREAM_FILTER_NO_FLUSH,
+	ELI_STREAM_FILTER_SYNC_FLUSH,
+	ELI_STREAM_FILTER_FINISH
+} ELI_STREAM_FILTER_FLUSH;
+
+// incremental (de)compressor between a filter stream and its source
+struct ELI_STREAM_FILTER {
+	z_stream z;
+	int deflating;
+	int finished; // end of the compressed stream was reached or written
+};
+
+// returns NULL if zlib could not be initialized
+struct ELI_STREAM_FILTER *stream_filter_new(int deflating,
+					    ELI_STREAM_ZLIB_FORMAT format,
+					    int level);
+void stream_filter_free(struct ELI_STREAM_FILTER *filter);
+// runs zlib over input into output, reports how much of both was used
+// returns 1 to continue, 0 at the end of the compressed stream and -1 if
+// the data is corrupted
+int stream_filter_process(struct ELI_STREAM_FILTER *filter, const char *input,
+			  size_t input_length, size_t *consumed, char *output,
+			  size_t output_size, size_t *produced,
+			  ELI_STREAM_FILTER_FLUSH flush);
+#endif
+
+#endif